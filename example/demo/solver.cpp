@@ -26,21 +26,38 @@ void freeShape(Shape shape) {
     };
 }
 
-Solver::Solver(float _ratio, float _step)
-    : arbiter(nullptr)
+Solver::Solver(float _ratio, float _step, int _method)
+    : bp(broadphase::create(_method))
+    , method(_method)
+    , arbiter(nullptr)
     , bodys(16)
     , contacts(16)
     , ratio(_ratio)
     , step(_step) {
     bodys.clear();
     contacts.clear();
+
+    if (method == broadphase::ABTREE) {
+        //! margins of proxies follow the motion of bodies, from a tenth of
+        //! a meter for resting bodies up to two meters for fast ones
+        static_cast<BroadPhase *>(bp)->setMarginRange(
+            0.1f * ratio, 2.0f * ratio);
+    } else if (method == broadphase::GRID) {
+        //! cells of ten meters fit the common bodies, the coarser levels
+        //! hold the ground and walls
+        static_cast<SpatialHash *>(bp)->setCellSize(10.0f * ratio, 4);
+    }
 }
 
 Solver::~Solver() {
+    for (auto contact : contacts) { delete contact; }
+
     for (auto body : bodys) {
         freeShape(body->getShape());
         delete body;
     }
+
+    delete bp;
 }
 
 int Solver::newCircleBody(const vec2 &center, float r) {
@@ -70,7 +87,7 @@ int Solver::newCircleBody(const vec2 &center, float r) {
 
     auto box = bboxOf(*e);
 
-    int id                       = bp.addObject(box, body);
+    int id                       = bp->addObject(box, body);
     body->getProperty().reserved = id;
     return id;
 }
@@ -111,7 +128,7 @@ int Solver::newEllipseBody(const vec2 &center, float rx, float ry) {
 
     auto box = bboxOf(*e);
 
-    int id                       = bp.addObject(box, body);
+    int id                       = bp->addObject(box, body);
     body->getProperty().reserved = id;
     return id;
 }
@@ -148,7 +165,7 @@ int Solver::newTriangleBody(const vec2 &a, const vec2 &b, const vec2 &c) {
 
     auto box = bboxOf(*e);
 
-    int id                       = bp.addObject(box, body);
+    int id                       = bp->addObject(box, body);
     body->getProperty().reserved = id;
     return id;
 }
@@ -191,7 +208,7 @@ int Solver::newRectangleBody(bbox2 rect) {
 
     auto box = bboxOf(*e);
 
-    int id                       = bp.addObject(box, body);
+    int id                       = bp->addObject(box, body);
     body->getProperty().reserved = id;
     return id;
 }
@@ -201,7 +218,7 @@ const std::vector<RigidBody *> &Solver::getObjects() const {
 }
 
 void *Solver::getUserdata(int id) {
-    return bp.getUserdata(id);
+    return bp->getUserdata(id);
 }
 
 void Solver::preSolve() {
@@ -209,32 +226,40 @@ void Solver::preSolve() {
 }
 
 void Solver::inSolve() {
-    bp.updatePairs();
+    bp->updatePairs();
 
     int  pairsCount;
-    auto pairs = bp.getPairs(&pairsCount);
+    auto pairs = bp->getPairs(&pairsCount);
 
-    //! no collsion detection should perform
-    if (pairsCount == 0) return;
+    //! contacts are owned by their pairs in the broadphase, so a staying
+    //! pair brings its contact along without any lookup
+    contacts.clear();
 
     for (int i = 0; i < pairsCount; ++i) {
+        auto contact = (DemoContact *)pairs[i].userdata;
+
+        if (pairs[i].event == broadphase::PairEvent::eEnd) {
+            if (contact != nullptr) {
+                LSPE_DEBUG(
+                    "Collision Test: "
+                    "(%d, %d) ended by BroadPhase",
+                    contact->indices[0],
+                    contact->indices[1]);
+
+                delete contact;
+            }
+            continue;
+        }
+
         RigidBody *bodys[2];
-        bodys[0] = (RigidBody *)bp.getUserdata(pairs[i].first);
-        bodys[1] = (RigidBody *)bp.getUserdata(pairs[i].second);
+        bodys[0] = (RigidBody *)bp->getUserdata(pairs[i].first);
+        bodys[1] = (RigidBody *)bp->getUserdata(pairs[i].second);
 
         if (!(bodys[0]->getBodyType() == BodyType::eDynamic
               && bodys[1]->getBodyType() == BodyType::eDynamic)) {
             continue;
         }
 
-        uint64_t hash =
-            (pairs[i].first & 0xffff) << 16 | (pairs[i].second & 0xffff);
-
-        auto it = std::find_if(
-            contacts.begin(), contacts.end(), [hash](const DemoContact &a) {
-                return a.hash == hash;
-            });
-
         collider.reset();
 
         collider.setTestPair(bodys[0]->getShape(), bodys[1]->getShape());
@@ -250,85 +275,76 @@ void Solver::inSolve() {
 
         bool collided = collider.collided();
 
-        if (!collided) {
-            if (it != contacts.end()) {
-                LSPE_DEBUG(
-                    "Collision Test: "
-                    "(%d, %d) ended by Collider",
-                    (*it).indices[0],
-                    (*it).indices[1]);
-
-                contacts.erase(it);
-            }
-            continue;
+        if (collided) {
+            arbiter.resetCollider(&collider);
+            arbiter.perform();
+            collided = arbiter.isCollided();
         }
 
-        arbiter.resetCollider(&collider);
-        arbiter.perform();
-
-        if (!arbiter.isCollided()) {
-            if (it != contacts.end()) {
+        if (!collided) {
+            if (contact != nullptr) {
                 LSPE_DEBUG(
                     "Collision Test: "
                     "(%d, %d) ended by Collider",
-                    (*it).indices[0],
-                    (*it).indices[1]);
+                    contact->indices[0],
+                    contact->indices[1]);
 
-                contacts.erase(it);
+                bp->setPairUserdata(pairs[i].first, pairs[i].second, nullptr);
+                delete contact;
             }
             continue;
         }
 
-        if (it != contacts.end()) {
+        if (contact != nullptr) {
             LSPE_DEBUG(
                 "Collision Test: "
                 "Stay Collision (%d, %d)",
-                (*it).indices[0],
-                (*it).indices[1]);
+                contact->indices[0],
+                contact->indices[1]);
 
+            contacts.push_back(contact);
             continue;
         }
 
-        DemoContact contact;
+        contact = new DemoContact;
 
-        contact.node[0].other   = bodys[1];
-        contact.node[0].contact = &contact;
+        contact->node[0].other   = bodys[1];
+        contact->node[0].contact = contact;
         arbiter.getClosetPoint(
-            contact.node[0].crossPointFromCentroid + 1,
-            contact.node[0].crossPointFromCentroid);
+            contact->node[0].crossPointFromCentroid + 1,
+            contact->node[0].crossPointFromCentroid);
 
-        contact.node[1].other   = bodys[0];
-        contact.node[1].contact = &contact;
+        contact->node[1].other   = bodys[0];
+        contact->node[1].contact = contact;
         arbiter.getClosetPoint(
-            contact.node[0].crossPointFromCentroid + 1,
-            contact.node[0].crossPointFromCentroid);
+            contact->node[0].crossPointFromCentroid + 1,
+            contact->node[0].crossPointFromCentroid);
 
-        contact.indices[0] = pairs[i].first;
-        contact.indices[1] = pairs[i].second;
+        contact->indices[0] = pairs[i].first;
+        contact->indices[1] = pairs[i].second;
 
-        arbiter.getPenetration(&contact.normal, &contact.penetration);
+        arbiter.getPenetration(&contact->normal, &contact->penetration);
 
-        contact.friction    = 0.0f; //! defaultly smooth surface
-        contact.restitution = 1.0f; //! defaultly perfectly elastic collision
-
-        contact.hash = hash;
+        contact->friction    = 0.0f; //! defaultly smooth surface
+        contact->restitution = 1.0f; //! defaultly perfectly elastic collision
 
+        bp->setPairUserdata(pairs[i].first, pairs[i].second, contact);
         contacts.push_back(contact);
 
         LSPE_DEBUG(
             "Collision Test: "
             "Begin Collision (%d, %d)",
-            contact.indices[0],
-            contact.indices[1]);
+            contact->indices[0],
+            contact->indices[1]);
     }
 
-    for (auto &e : contacts) { //! apply collision response
-        auto  a   = e.node[1].other;
-        auto  b   = e.node[0].other;
+    for (auto e : contacts) { //! apply collision response
+        auto  a   = e->node[1].other;
+        auto  b   = e->node[0].other;
         vec2  oa  = a->getCentroid();
         vec2  ob  = b->getCentroid();
-        vec2  pa  = e.node[0].crossPointFromCentroid[0];
-        vec2  pb  = e.node[0].crossPointFromCentroid[1];
+        vec2  pa  = e->node[0].crossPointFromCentroid[0];
+        vec2  pb  = e->node[0].crossPointFromCentroid[1];
         vec2  ra  = pa - oa;
         vec2  rb  = pb - ob;
         float wa  = a->getProperty().angularVelocity;
@@ -339,7 +355,7 @@ void Solver::inSolve() {
         float imb = b->getInvMass();
         float iia = a->getInvInertia();
         float iib = b->getInvInertia();
-        vec2  n   = e.normal;
+        vec2  n   = e->normal;
         float Mn  = 1.0
                  / (ima + cross(ra, n) * cross(ra, n) * iia + imb
                     + cross(rb, n) * cross(rb, n) * iib);
@@ -357,16 +373,31 @@ void Solver::inSolve() {
 }
 
 void Solver::postSolve() {
+    std::vector<int>   ids;
+    std::vector<bbox2> boxes;
+    std::vector<vec2>  displacements;
+    ids.reserve(bodys.size());
+    boxes.reserve(bodys.size());
+    displacements.reserve(bodys.size());
+
     for (auto body : bodys) {
+        vec2 center = centerOf(body->getShape());
         body->postUpdate(step);
 
-        int id = body->getProperty().reserved;
-        bp.moveObject(id, bboxOf(body->getShape()), vec2(0, 0));
+        ids.push_back(body->getProperty().reserved);
+        boxes.push_back(bboxOf(body->getShape()));
+        displacements.push_back(centerOf(body->getShape()) - center);
     }
+
+    //! move all proxies at once, escapees are reinserted in one batch
+    //! the real displacements let the tree predict the motion
+    bp->moveObjects(
+        ids.data(), boxes.data(), displacements.data(), ids.size());
 }
 
 void Solver::traverse(abt::fnvisit visit, void *extra, int method) {
-    bp.traverse(visit, extra, method);
+    if (this->method != broadphase::ABTREE) return;
+    static_cast<BroadPhase *>(bp)->traverse(visit, extra, method);
 }
 
 vec2 Solver::centerOf(Shape shape) {
@@ -39,16 +39,21 @@ struct DemoContact {
         float normal;
         float tangent;
     } force; //! seperated by normal
-
-    uint32_t hash; //! to check if two contacts is the same
 };
 
 class Solver {
 public:
     Solver() = delete;
-    Solver(float _ratio = 1000, float _step = 0.1f);
+    Solver(
+        float _ratio  = 1000,
+        float _step   = 0.1f,
+        int   _method = broadphase::ABTREE);
+    //! _method chooses the broadphase, see broadphase::create()
     ~Solver();
 
+    Solver(const Solver &)            = delete;
+    Solver &operator=(const Solver &) = delete;
+
     int newCircleBody(const vec2 &center, float r);
     [[deprecated]] int
         newPolygenBody(std::vector<vec2> &vertices); //! randomly generated
@@ -66,6 +71,7 @@ public:
     void *getUserdata(int id);
 
     void traverse(abt::fnvisit visit, void *extra, int method = abt::PREORDER);
+    //! traverse the abtree, does nothing with the other broadphases
 
     static vec2 centerOf(Shape shape);
 
@@ -75,7 +81,8 @@ protected:
     static collision::fnsupport getDefaultSupport(ShapeType type);
 
 private:
-    BroadPhase bp;
+    broadphase::Backend *bp;
+    int                  method; //! method of bp
 
     Arbiter  arbiter;
     Collider collider;
@@ -87,7 +94,8 @@ private:
     //! contacts stored all the onCollsion bodys
     //! in current version, we use default contact attributes
     //! (except for penetration vector)
-    std::vector<DemoContact> contacts;
+    //! each contact is owned by its pair in bp (see inSolve())
+    std::vector<DemoContact *> contacts;
 
     float ratio;
     float step;
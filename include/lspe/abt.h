@@ -10,8 +10,13 @@
  *  @NOTES: Reference "box2d"
  *******************************/
 
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+
 #include "../lspe/base/base.h"
 #include "../lspe/base/vec.h"
+#include "../lspe/base/simd.h"
 #include "../lspe/bbox.h"
 
 namespace lspe {
@@ -19,7 +24,13 @@ namespace lspe {
 namespace abt {
 struct node;
 }; // namespace abt
+namespace shape {
+struct Polygen;
+}; // namespace shape
 class abtree;
+class abtree4;
+class abtree16;
+class abtreeb;
 
 namespace abt {
 
@@ -31,13 +42,62 @@ enum {
     POSTORDER
 };
 
+//! methods of abtree::rebuild()
+enum {
+    SAH, //! top-down binned SAH, best tree quality
+    LBVH //! parallel Morton-code linear BVH, fastest to build
+};
+
 //! fnvisit allows a custom visit callback function
 //! enable providing an extra pointer for more flexible operation
 //! return false if you want to terminate the visit procedure
 //! otherwise return true
-//! tip: valid part of node includes { box, userdata, height, moved }
+//! tip: valid part of node includes
+//!      { box, userdata, height, moved, index, category }
+//! tip: abtree::query() and abtree::traverse() also accept any callable
+//! of signature bool(const node *), which can be inlined by the compiler
+//! the fnvisit versions are thin wrappers of them
 typedef bool (*fnvisit)(const node *, void *extra);
 
+//! fnpair receives a pair of overlapping leaves
+//! return false to terminate the procedure
+typedef bool (*fnpair)(const node *, const node *, void *extra);
+
+//! fnraycast receives a leaf whose box is hit by the ray
+//! origin + t * dir with t in [0, maxFraction]
+//! return the new maxFraction (usually the exact hit fraction) to clip
+//! the ray, return maxFraction to go on, return 0 to terminate
+typedef float (*fnraycast)(const node *, float maxFraction, void *extra);
+
+//! fnraybatch is the fnraycast of a batch of rays
+//! ray is the index of the ray in the batch, the return value only
+//! clips or terminates that ray
+typedef float (*fnraybatch)(
+    const node *, int ray, float maxFraction, void *extra);
+
+//! fnnearest receives leaves in order of increasing distance
+//! return false to terminate the procedure
+typedef bool (*fnnearest)(const node *, float distance, void *extra);
+
+//! fnsweep receives leaves in order of increasing time of entry
+//! fraction is the entry time as a fraction of the displacement
+//! return false to accept the hit and terminate the procedure
+typedef bool (*fnsweep)(const node *, float fraction, void *extra);
+
+//! reciprocal of a ray direction for the slab test
+//! zero components map to a huge finite value so that no NaN appears
+static inline vec2 inverseOf(const vec2 &dir);
+
+//! slab test of the ray origin + t * dir (invdir = inverseOf(dir))
+//! against box for t in [0, maxFraction]
+//! on hit store the entry fraction into fraction and return true
+static inline bool raycast(
+    const bbox2 &box,
+    const vec2  &origin,
+    const vec2  &invdir,
+    float        maxFraction,
+    float       &fraction);
+
 void traverse(
     abtree *tree, fnvisit visit, void *extra = nullptr, int method = PREORDER);
 
@@ -50,8 +110,6 @@ struct node {
                     //! act as a abtree node when current node is valid
         int next;   //! point to next available free node
                     //! act as a linked list node when current node is free
-        int index;  //! index of this node
-                    //! this is only available in query function
     };
 
     int left, right; //! children (index)
@@ -63,29 +121,179 @@ struct node {
                 //! it indicates that the object has finished movement or
                 //! placement
 
+    int index; //! index of this node in the node pool
+               //! assigned by abtree::allocate() and kept stable
+               //! it fills the tail padding so sizeof(node) is unchanged
+
+    int32_t category; //! category bit mask (see lspe::bitmask)
+                      //! leaf: categories of the object, all by default
+                      //! internal: OR of the categories of its subtree
+
+    float margin; //! leaf: extension of the fatten box of the object
+                  //! adapted to its motion (see setMarginRange())
+
     bool isLeaf() const; //! check whether this node is a leaf node
 };
 
+//! the part of node read by queries, { box, left, right, category }
+//! abtree mirrors it in a packed array (28 bytes per node instead of 56)
+//! so that traversal never pulls userdata and metadata into the cache
+//! the full node is touched only when a leaf is reported
+struct hotnode {
+    bbox2   box;
+    int     left, right;
+    int32_t category;
+};
+
+//! node stack for the iterative traversal of abtree
+//! elements live inside the stack object itself (usually on the call
+//! stack), so ordinary queries never touch the heap; the stack grows
+//! into heap memory only when the tree is deeper than the inline capacity
+//! T must be trivially copyable, node indices (int) by default
+template <typename T = int>
+class stack {
+public:
+    stack();
+    ~stack();
+
+    stack(const stack &) = delete;
+    stack &operator=(const stack &) = delete;
+
+    void push(const T &e);
+    T    pop();
+    bool empty() const;
+
+private:
+    static const int capacity = 256; //! enough for any balanced abtree
+
+    T   m_inline[capacity];
+    T  *m_data;
+    int m_top;
+    int m_capacity;
+};
+
+//! max priority queue (binary heap), e.g. the k best results so far
+//! same storage policy as stack, T must be trivially copyable and
+//! ordered by operator<
+template <typename T>
+class queue {
+public:
+    queue();
+    ~queue();
+
+    queue(const queue &)            = delete;
+    queue &operator=(const queue &) = delete;
+
+    void     push(const T &e);
+    T        pop(); //! remove and return the greatest element
+    const T &top() const;
+    bool     empty() const;
+
+private:
+    static const int capacity = 256;
+
+    T   m_inline[capacity];
+    T  *m_data;
+    int m_size;
+    int m_capacity;
+};
+
+//! convex region for the separating axis test against node boxes
+//! keeps the bounding box of the region (the x and y axes) and the
+//! projection interval of the region on each of its own edge normals
+class convex {
+public:
+    convex(const shape::Polygen &polygen); //! polygen must be convex
+    convex(const obb2 &box);
+    ~convex();
+
+    convex(const convex &)            = delete;
+    convex &operator=(const convex &) = delete;
+
+    const bbox2 &bound() const; //! bounding box of the region
+
+    bool overlap(const bbox2 &box) const;
+    //! false if some axis separates the region from box
+
+private:
+    struct axis {
+        vec2  normal;
+        float lower, upper; //! projection interval of the region
+    };
+
+    static const int capacity = 8; //! axes stored inline
+
+    bbox2 m_box;
+    axis  m_inline[capacity];
+    axis *m_axes;
+    int   m_naxis;
+};
+
 }; // namespace abt
 
 class abtree {
 public:
     friend void abt::traverse(abtree *, abt::fnvisit, void *, int);
+    friend class abtree4;
+    friend class abtree16;
+    friend class abtreeb;
 
 public:
     abtree();
     ~abtree();
 
     void setExtension(float r);
-    //! set extension of bounding box
+    //! set extension of bounding box, the initial margin of new objects
+
+    void setMarginRange(float lower, float upper);
+    //! let every object adapt its own margin within [lower, upper]
+    //! a margin grows on each escape from its fatten box, by the speed
+    //! of the object at least, and decays while the object stays inside
+    //! so that resting objects end up with tight boxes
+    //! lower == upper (default, pass (0, 0)) keeps margins fixed and
+    //! turns the adaptation off again
+    //! the margins of the objects and the margin of new objects (the
+    //! extension) are clamped into the range, or reset to the extension
+    //! when it is off, boxes follow at their next reinsertion
 
     int addObject(const bbox2 &box, void *userdata);
     //! add a new object with a bounding box
     //! providing an optional userdata param (usually real object pointer)
+    //! the object belongs to all categories until setCategory()
 
     void delObject(int id);
     //! delete the object by id (given by addObject())
 
+    void build(const bbox2 *boxes, void **userdata, int n, int *ids = nullptr);
+    //! discard all objects and bulk build the tree from n boxes
+    //! the hierarchy is built top-down with binned SAH (perimeter in 2D)
+    //! userdata is optional, ids (optional) receives the id of each box
+
+    void rebuild(int method = abt::LBVH, int threads = 0);
+    //! throw away all internal nodes and rebuild them over current leaves
+    //! ids of objects are kept, so query() and traverse() work unchanged
+    //! threads = 0 picks the hardware concurrency (LBVH only)
+
+    void optimize(int budget);
+    //! improve tree quality incrementally with cost-reducing rotations
+    //! visit at most budget internal nodes per call, continuing from
+    //! where the previous call stopped, call it once per step
+    //! reference: "Dynamic Bounding Volume Hierarchies" (Erin Catto)
+
+    void refit(int budget = 0);
+    //! recompute the boxes of all internal nodes bottom-up in one pass
+    //! after setObjectBBox(), the topology is kept as it is
+    //! then call optimize(budget) if budget > 0 to repair the quality
+    //! suits groups of objects moving coherently (platforms, layers)
+
+    float cost() const;
+    //! SAH cost of the tree (total perimeter of internal nodes)
+
+    void setObjectBBox(int id, const bbox2 &box);
+    //! replace the bounding box of the object in place (then fatten it)
+    //! ancestors are NOT updated, so refit() or rebuild() must be called
+    //! before the next query or modification of the tree
+
     bool moveObject(int id, const bbox2 &box, const vec2 &displacement);
     //! update bounding box of the object and apply the displacement
     //! it'll adjust the bounding box and reinsert the object if the
@@ -93,18 +301,180 @@ public:
     //! return true if object was reinserted
     //! otherwise return false
 
+    int moveObjects(
+        const int   *ids,
+        const bbox2 *boxes,
+        const vec2  *displacements,
+        int          n,
+        int         *moved = nullptr);
+    //! batch version of moveObject() over n distinct objects
+    //! displacements is optional (nullptr means no displacement)
+    //! objects are classified 4 at a time with SIMD, then only the
+    //! escapees are reinserted, in the order of a Morton curve
+    //! return the number of reinserted objects, whose ids are written
+    //! into moved (optional, room for n ids) in the reinsertion order
+
     bbox2 getFattenBBox(int id) const;
 
+    void setCategory(int id, int32_t category);
+    //! set the category bit mask of the object (see lspe::bitmask)
+    //! and refresh the aggregated masks of its ancestors
+
+    int32_t getCategory(int id) const;
+
     void *getUserdata(int id) const;
 
     bool wasMoved(int id);
     void setUnMoved(int id);
     //! clear move flag of the node
 
+    int objectCount() const; //! number of objects (leaves) in the tree
+
+    bool owns(const abt::node *node) const;
+    //! whether node points into the node pool of this tree
+
     void query(abt::fnvisit processor, const bbox2 &box, void *extra = nullptr);
     void
         query(abt::fnvisit processor, const vec2 &point, void *extra = nullptr);
 
+    template <typename F>
+    void query(const bbox2 &box, F &&processor);
+    //! call processor(const abt::node *) for each leaf overlapping box
+    //! return false from processor to stop the query
+
+    template <typename F>
+    void query(const vec2 &point, F &&processor);
+    //! call processor(const abt::node *) for each leaf containing point
+
+    void query(
+        abt::fnvisit          processor,
+        const shape::Polygen &polygen,
+        void                 *extra = nullptr);
+    void query(abt::fnvisit processor, const obb2 &box, void *extra = nullptr);
+
+    template <typename F>
+    void query(const shape::Polygen &polygen, F &&processor);
+    //! call processor(const abt::node *) for each leaf overlapping the
+    //! convex polygen, nodes are culled with the separating axis test
+
+    template <typename F>
+    void query(const obb2 &box, F &&processor);
+    //! call processor(const abt::node *) for each leaf overlapping the
+    //! oriented box
+
+    template <typename F>
+    void query(const abt::convex &region, F &&processor);
+    //! query a prepared convex region, which can be reused across trees
+
+    void query(
+        abt::fnvisit processor,
+        const bbox2 &box,
+        int32_t      mask,
+        void        *extra = nullptr);
+    void query(
+        abt::fnvisit processor,
+        const vec2  &point,
+        int32_t      mask,
+        void        *extra = nullptr);
+
+    template <typename F>
+    void query(const bbox2 &box, int32_t mask, F &&processor);
+    //! same as query(box, processor) but only leaves whose category
+    //! intersects mask are reported, subtrees whose aggregated category
+    //! doesn't intersect mask are skipped as a whole
+
+    template <typename F>
+    void query(const vec2 &point, int32_t mask, F &&processor);
+    //! filtered version of query(point, processor)
+
+    void queryPairs(abt::fnpair processor, void *extra = nullptr);
+
+    template <typename F>
+    void queryPairs(F &&processor);
+    //! descend the tree against itself once and call
+    //! processor(const abt::node *, const abt::node *) for every pair of
+    //! overlapping leaves, each unordered pair is reported exactly once
+
+    void raycast(
+        abt::fnraycast processor,
+        const vec2    &origin,
+        const vec2    &dir,
+        float          maxFraction,
+        void          *extra = nullptr);
+
+    template <typename F>
+    void raycast(
+        const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor);
+    //! cast the ray origin + t * dir, t in [0, maxFraction], and call
+    //! float processor(const abt::node *, float maxFraction) for each leaf
+    //! whose box is hit (see abt::fnraycast for the return value)
+    //! nearer children are visited first, so clipping culls early
+    //! a segment p -> q is cast with dir = q - p and maxFraction = 1
+
+    void raycast(
+        abt::fnraybatch processor,
+        const vec2     *origins,
+        const vec2     *dirs,
+        const float    *maxFractions,
+        int             n,
+        void           *extra = nullptr);
+
+    template <typename F>
+    void raycast(
+        const vec2  *origins,
+        const vec2  *dirs,
+        const float *maxFractions,
+        int          n,
+        F          &&processor);
+    //! cast n rays as packets of 4 consecutive rays, each packet shares a
+    //! single traversal and tests a node box against its 4 rays with SIMD
+    //! processor is float(const abt::node *, int ray, float maxFraction)
+    //! works best when consecutive rays are coherent (fans, spreads)
+
+    void nearest(
+        abt::fnnearest processor,
+        const vec2    &point,
+        int            k,
+        void          *extra = nullptr);
+    void nearest(
+        abt::fnnearest processor,
+        const vec2    &point,
+        int            k,
+        float          maxDistance,
+        void          *extra = nullptr);
+
+    template <typename F>
+    void nearest(const vec2 &point, int k, F &&processor);
+    //! call processor(const abt::node *, float distance) for the k leaves
+    //! nearest to point, in order of increasing distance
+    //! distances are measured to the stored (fattened) boxes, so callers
+    //! wanting exact shape distances should ask for a few more leaves
+
+    template <typename F>
+    void nearest(const vec2 &point, int k, float maxDistance, F &&processor);
+    //! same as above but only leaves within maxDistance are reported
+
+    void sweep(
+        abt::fnsweep processor,
+        const bbox2 &box,
+        const vec2  &displacement,
+        void        *extra = nullptr);
+
+    template <typename F>
+    void sweep(const bbox2 &box, const vec2 &displacement, F &&processor);
+    //! move box by displacement and call
+    //! bool processor(const abt::node *, float fraction) for each leaf
+    //! it hits on the way, in order of the time of entry
+    //! leaves overlapping box at the start come first with fraction 0
+    //! nodes are cast as rays against boxes grown by the half extent of
+    //! box, and expanded best-first so the order is exact
+
+    template <int Order = abt::PREORDER, typename F>
+    void traverse(F &&visit);
+    //! iterative traversal calling visit(const abt::node *)
+    //! returning false skips the part of the current subtree that has not
+    //! been visited yet (children in PREORDER, right subtree in INORDER)
+
 protected:
 
 private:
@@ -114,14 +484,45 @@ private:
 
     void insert(int node);  //! insert a leaf node into abtree
                             //! this will call allocate() firstly
+    int  siblingOf(const bbox2 &box) const; //! best sibling for a new leaf
+                                            //! of box, by insertion cost
     void remove(int node);  //! remove the leaf node
     int  balance(int node); //! perform tree balancing
                             //! return new root of the subtree
 
+    bool rotate(int node); //! apply the best cost-reducing rotation
+                           //! among the children and grandchildren
+                           //! return false if no rotation helps
+    void swap(int a, int b); //! exchange two nodes of different parents
+
+    bbox2
+        fatten(const bbox2 &box, const vec2 &displacement, float margin) const;
+    //! fatten box by margin and stretch it along the displacement
+
+    void adapt(int node, const vec2 &displacement, bool escaped);
+    //! update the margin of the leaf after a move (see setMarginRange())
+
+    void sync(int node); //! copy { box, left, right, category } of the
+                         //! node into m_hot, required after any change
+
+    template <typename T, typename F>
+    void walk(const T &test, F &&processor);
+    //! shared traversal of the queries
+    //! test(const abt::hotnode &) tells whether to enter the node
+
+    void reset(int capacity); //! drop all nodes and resize the node pool
+    int  buildTopDown(int *leaves, int n); //! build internal nodes over
+                                           //! the given leaves (binned SAH)
+                                           //! return root of the new tree
+    int  buildLinear(int *leaves, int n, int threads); //! same as above
+                                                       //! but LBVH
+
     int height() const;           //! get height of abtree
     int heightOf(int node) const; //! get height of specific node
 
-    abt::node *m_nodes; //! node pool
+    abt::node    *m_nodes; //! node pool
+    abt::hotnode *m_hot;   //! packed copy of the hot fields of m_nodes
+                           //! indexed the same way as m_nodes
     int        m_root;  //! index of root node
     int        m_nnode; //! number of nodes
                         //! m_nnode = N(internal node) + N(leaf node)
@@ -133,6 +534,620 @@ private:
 
     float m_extension; //! bounding box extension for leaf node insertion
                        //! defaultly 2 (meters)
+
+    float m_minMargin; //! range of the adaptive margins of leaves
+    float m_maxMargin; //! adaptation is off while they are equal
+    float m_margin;    //! margin of new leaves, m_extension clamped into
+                       //! the range while adaptation is on
+
+    int m_cursor; //! pool position where optimize() continues
 };
 
 }; // namespace lspe
+
+namespace lspe {
+
+namespace abt {
+
+inline bool node::isLeaf() const {
+    return left == null && right == null;
+}
+
+vec2 inverseOf(const vec2 &dir) {
+    vec2 invdir;
+    invdir.x = dir.x != 0.0f ? 1.0f / dir.x : FLT_MAX;
+    invdir.y = dir.y != 0.0f ? 1.0f / dir.y : FLT_MAX;
+    return invdir;
+}
+
+bool raycast(
+    const bbox2 &box,
+    const vec2  &origin,
+    const vec2  &invdir,
+    float        maxFraction,
+    float       &fraction) {
+    float tx1 = (box.lower.x - origin.x) * invdir.x;
+    float tx2 = (box.upper.x - origin.x) * invdir.x;
+    float ty1 = (box.lower.y - origin.y) * invdir.y;
+    float ty2 = (box.upper.y - origin.y) * invdir.y;
+
+    float tmin = max(max(min(tx1, tx2), min(ty1, ty2)), 0.0f);
+    float tmax = min(min(max(tx1, tx2), max(ty1, ty2)), maxFraction);
+
+    fraction = tmin;
+    return tmin <= tmax;
+}
+
+template <typename T>
+inline stack<T>::stack()
+    : m_data(m_inline)
+    , m_top(0)
+    , m_capacity(capacity) {}
+
+template <typename T>
+inline stack<T>::~stack() {
+    if (m_data != m_inline) { ::free(m_data); }
+}
+
+template <typename T>
+inline void stack<T>::push(const T &e) {
+    if (m_top == m_capacity) { //! spill into heap memory
+        T *old_data = m_data;
+
+        m_capacity *= 2;
+        m_data     = (T *)malloc(m_capacity * sizeof(T));
+
+        LSPE_ALWAYS_ASSERT(m_data != nullptr);
+        memcpy(m_data, old_data, m_top * sizeof(T));
+        if (old_data != m_inline) { ::free(old_data); }
+    }
+
+    m_data[m_top++] = e;
+}
+
+template <typename T>
+inline T stack<T>::pop() {
+    LSPE_ASSERT(m_top > 0);
+    return m_data[--m_top];
+}
+
+template <typename T>
+inline bool stack<T>::empty() const {
+    return m_top == 0;
+}
+
+template <typename T>
+inline queue<T>::queue()
+    : m_data(m_inline)
+    , m_size(0)
+    , m_capacity(capacity) {}
+
+template <typename T>
+inline queue<T>::~queue() {
+    if (m_data != m_inline) { ::free(m_data); }
+}
+
+template <typename T>
+inline void queue<T>::push(const T &e) {
+    if (m_size == m_capacity) { //! spill into heap memory
+        T *old_data = m_data;
+
+        m_capacity *= 2;
+        m_data     = (T *)malloc(m_capacity * sizeof(T));
+
+        LSPE_ALWAYS_ASSERT(m_data != nullptr);
+        memcpy(m_data, old_data, m_size * sizeof(T));
+        if (old_data != m_inline) { ::free(old_data); }
+    }
+
+    //! sift up
+    int i = m_size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!(m_data[parent] < e)) break;
+        m_data[i] = m_data[parent];
+        i         = parent;
+    }
+    m_data[i] = e;
+}
+
+template <typename T>
+inline T queue<T>::pop() {
+    LSPE_ASSERT(m_size > 0);
+
+    T greatest = m_data[0];
+    T last  = m_data[--m_size];
+
+    //! sift down
+    int i = 0;
+    while (true) {
+        int child = i * 2 + 1;
+        if (child >= m_size) break;
+        if (child + 1 < m_size && m_data[child] < m_data[child + 1]) {
+            ++child;
+        }
+        if (!(last < m_data[child])) break;
+        m_data[i] = m_data[child];
+        i         = child;
+    }
+    m_data[i] = last;
+
+    return greatest;
+}
+
+template <typename T>
+inline const T &queue<T>::top() const {
+    LSPE_ASSERT(m_size > 0);
+    return m_data[0];
+}
+
+template <typename T>
+inline bool queue<T>::empty() const {
+    return m_size == 0;
+}
+
+inline const bbox2 &convex::bound() const {
+    return m_box;
+}
+
+inline bool convex::overlap(const bbox2 &box) const {
+    if (!lspe::overlap(m_box, box)) return false;
+
+    vec2 center = (box.lower + box.upper) * 0.5f;
+    vec2 extent = (box.upper - box.lower) * 0.5f;
+
+    for (int i = 0; i < m_naxis; ++i) {
+        const axis &e = m_axes[i];
+        float       s = dot(center, e.normal);
+        float r = extent.x * fabs(e.normal.x) + extent.y * fabs(e.normal.y);
+        if (s + r < e.lower || s - r > e.upper) return false;
+    }
+
+    return true;
+}
+
+}; // namespace abt
+
+}; // namespace lspe
+
+namespace lspe {
+
+template <typename F>
+void abtree::query(const bbox2 &box, F &&processor) {
+    walk(
+        [&box](const abt::hotnode &node) {
+            return overlap(node.box, box);
+        },
+        processor);
+}
+
+template <typename F>
+void abtree::query(const vec2 &point, F &&processor) {
+    walk(
+        [&point](const abt::hotnode &node) {
+            return contain(node.box, point);
+        },
+        processor);
+}
+
+template <typename F>
+void abtree::query(const shape::Polygen &polygen, F &&processor) {
+    abt::convex region(polygen);
+    query(region, std::forward<F>(processor));
+}
+
+template <typename F>
+void abtree::query(const obb2 &box, F &&processor) {
+    abt::convex region(box);
+    query(region, std::forward<F>(processor));
+}
+
+template <typename F>
+void abtree::query(const abt::convex &region, F &&processor) {
+    walk(
+        [&region](const abt::hotnode &node) {
+            return region.overlap(node.box);
+        },
+        processor);
+}
+
+template <typename F>
+void abtree::query(const bbox2 &box, int32_t mask, F &&processor) {
+    walk(
+        [&box, mask](const abt::hotnode &node) {
+            return (node.category & mask) != 0 && overlap(node.box, box);
+        },
+        processor);
+}
+
+template <typename F>
+void abtree::query(const vec2 &point, int32_t mask, F &&processor) {
+    walk(
+        [&point, mask](const abt::hotnode &node) {
+            return (node.category & mask) != 0 && contain(node.box, point);
+        },
+        processor);
+}
+
+template <typename T, typename F>
+void abtree::walk(const T &test, F &&processor) {
+    if (m_root == abt::null) return;
+
+    abt::stack<> stack;
+    stack.push(m_root);
+
+    while (!stack.empty()) {
+        int                 index = stack.pop();
+        const abt::hotnode &node  = m_hot[index];
+        if (!test(node)) continue;
+
+        if (node.left == abt::null) {
+            if (!processor(m_nodes + index)) return;
+        } else { //! push right first to keep the preorder of left subtree
+            stack.push(node.right);
+            stack.push(node.left);
+        }
+    }
+}
+
+template <typename F>
+void abtree::queryPairs(F &&processor) {
+    if (m_root == abt::null) return;
+
+    //! entries are pushed as (a, b) pairs, a == b marks a self test
+    abt::stack<> stack;
+    stack.push(m_root);
+    stack.push(m_root);
+
+    while (!stack.empty()) {
+        int b = stack.pop();
+        int a = stack.pop();
+
+        const abt::hotnode &A = m_hot[a];
+        const abt::hotnode &B = m_hot[b];
+
+        bool leafA = A.left == abt::null;
+        bool leafB = B.left == abt::null;
+
+        if (a == b) { //! self test: both children and the cross pair
+            if (leafA) continue;
+            stack.push(A.left);
+            stack.push(A.right);
+            stack.push(A.right);
+            stack.push(A.right);
+            stack.push(A.left);
+            stack.push(A.left);
+            continue;
+        }
+
+        if (!overlap(A.box, B.box)) continue;
+
+        if (leafA && leafB) {
+            if (!processor(m_nodes + a, m_nodes + b)) return;
+            continue;
+        }
+
+        //! descend into the larger internal node
+        bool splitA =
+            leafB || (!leafA && perimeterOf(A.box) >= perimeterOf(B.box));
+        if (splitA) {
+            stack.push(A.right);
+            stack.push(b);
+            stack.push(A.left);
+            stack.push(b);
+        } else {
+            stack.push(a);
+            stack.push(B.right);
+            stack.push(a);
+            stack.push(B.left);
+        }
+    }
+}
+
+template <typename F>
+void abtree::raycast(
+    const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor) {
+    if (m_root == abt::null) return;
+
+    struct entry {
+        int   node;
+        float fraction; //! entry fraction of the ray into the node box
+    };
+
+    const vec2 invdir = abt::inverseOf(dir);
+
+    float fraction;
+    if (!abt::raycast(
+            m_hot[m_root].box, origin, invdir, maxFraction, fraction)) {
+        return;
+    }
+
+    abt::stack<entry> stack;
+    stack.push({m_root, fraction});
+
+    while (!stack.empty()) {
+        entry top = stack.pop();
+        if (top.fraction > maxFraction) continue; //! clipped after the push
+
+        const abt::hotnode &node = m_hot[top.node];
+
+        if (node.left == abt::null) {
+            float value = processor(m_nodes + top.node, maxFraction);
+            if (value <= 0.0f) return;
+            maxFraction = min(maxFraction, value);
+            continue;
+        }
+
+        float fl, fr;
+        bool  hl = abt::raycast(
+            m_hot[node.left].box, origin, invdir, maxFraction, fl);
+        bool hr = abt::raycast(
+            m_hot[node.right].box, origin, invdir, maxFraction, fr);
+
+        //! push the farther child first so that the nearer one pops first
+        if (hl && hr) {
+            if (fl <= fr) {
+                stack.push({node.right, fr});
+                stack.push({node.left, fl});
+            } else {
+                stack.push({node.left, fl});
+                stack.push({node.right, fr});
+            }
+        } else if (hl) {
+            stack.push({node.left, fl});
+        } else if (hr) {
+            stack.push({node.right, fr});
+        }
+    }
+}
+
+template <typename F>
+void abtree::raycast(
+    const vec2  *origins,
+    const vec2  *dirs,
+    const float *maxFractions,
+    int          n,
+    F          &&processor) {
+    using namespace simd;
+
+    if (m_root == abt::null) return;
+
+    const f32x4 zero = splat(0.0f);
+
+    for (int base = 0; base < n; base += 4) {
+        int count = min(4, n - base);
+
+        //! unused lanes get a negative fraction and never hit
+        float ox[4], oy[4], ix[4], iy[4], tmax[4];
+        vec2  meandir(0, 0);
+        for (int k = 0; k < 4; ++k) {
+            if (k < count) {
+                vec2 invdir = abt::inverseOf(dirs[base + k]);
+                ox[k]       = origins[base + k].x;
+                oy[k]       = origins[base + k].y;
+                ix[k]       = invdir.x;
+                iy[k]       = invdir.y;
+                tmax[k]     = maxFractions[base + k];
+                meandir     = meandir + dirs[base + k];
+            } else {
+                ox[k] = oy[k] = ix[k] = iy[k] = 0.0f;
+                tmax[k]                       = -1.0f;
+            }
+        }
+
+        const f32x4 vox = load(ox), voy = load(oy);
+        const f32x4 vix = load(ix), viy = load(iy);
+
+        abt::stack<> stack;
+        stack.push(m_root);
+
+        while (!stack.empty()) {
+            int                 index = stack.pop();
+            const abt::hotnode &node  = m_hot[index];
+
+            //! slab test of the node box against all rays of the packet
+            f32x4 tx1 = (splat(node.box.lower.x) - vox) * vix;
+            f32x4 tx2 = (splat(node.box.upper.x) - vox) * vix;
+            f32x4 ty1 = (splat(node.box.lower.y) - voy) * viy;
+            f32x4 ty2 = (splat(node.box.upper.y) - voy) * viy;
+
+            f32x4 tnear = max(max(min(tx1, tx2), min(ty1, ty2)), zero);
+            f32x4 tfar  = min(min(max(tx1, tx2), max(ty1, ty2)), load(tmax));
+
+            int mask = movemask(cmple(tnear, tfar));
+            if (mask == 0) continue;
+
+            if (node.left == abt::null) {
+                bool alive = false;
+                for (int k = 0; k < count; ++k) {
+                    if (mask & (1 << k)) {
+                        float value =
+                            processor(m_nodes + index, base + k, tmax[k]);
+                        tmax[k] = value <= 0.0f ? -1.0f : min(tmax[k], value);
+                    }
+                    alive = alive || tmax[k] >= 0.0f;
+                }
+                if (!alive) break; //! all rays of the packet terminated
+                continue;
+            }
+
+            //! visit first the child lying ahead along the mean direction
+            vec2 offset = centerOf(m_hot[node.right].box)
+                        - centerOf(m_hot[node.left].box);
+            if (dot(offset, meandir) >= 0.0f) {
+                stack.push(node.right);
+                stack.push(node.left);
+            } else {
+                stack.push(node.left);
+                stack.push(node.right);
+            }
+        }
+    }
+}
+
+template <typename F>
+void abtree::nearest(const vec2 &point, int k, F &&processor) {
+    nearest(point, k, FLT_MAX, std::forward<F>(processor));
+}
+
+template <typename F>
+void abtree::nearest(
+    const vec2 &point, int k, float maxDistance, F &&processor) {
+    LSPE_ASSERT(maxDistance >= 0.0f);
+
+    if (m_root == abt::null || k <= 0) return;
+
+    struct entry {
+        int   node;
+        float distance; //! squared distance to the node box
+
+        bool operator<(const entry &other) const {
+            return distance < other.distance;
+        }
+    };
+
+    //! squared bound, FLT_MAX stays unbounded instead of overflowing
+    float bound =
+        maxDistance < sqrtf(FLT_MAX) ? maxDistance * maxDistance : FLT_MAX;
+
+    //! depth-first, nearer child first, pruned against the k-th nearest
+    //! leaf found so far, which sits on top of the result queue
+    //! distances are recomputed on pop, which beats carrying them along
+    abt::queue<entry> best;
+    int               count = 0;
+
+    const abt::hotnode *hot = m_hot;
+
+    abt::stack<> stack;
+    stack.push(m_root);
+
+    while (!stack.empty()) {
+        int                 index    = stack.pop();
+        const abt::hotnode &node     = hot[index];
+        float               distance = sqrDistanceOf(node.box, point);
+
+        if (distance > bound) continue;
+        if (count == k && distance >= bound) continue;
+
+        if (node.left == abt::null) {
+            best.push({index, distance});
+            if (++count > k) {
+                best.pop();
+                --count;
+            }
+            if (count == k) { bound = best.top().distance; }
+            continue;
+        }
+
+        float dl = sqrDistanceOf(hot[node.left].box, point);
+        float dr = sqrDistanceOf(hot[node.right].box, point);
+        if (dl <= dr) {
+            if (dr <= bound) { stack.push(node.right); }
+            if (dl <= bound) { stack.push(node.left); }
+        } else {
+            if (dl <= bound) { stack.push(node.left); }
+            if (dr <= bound) { stack.push(node.right); }
+        }
+    }
+
+    //! the queue pops the farthest first, reverse it through a stack
+    abt::stack<entry> order;
+    while (!best.empty()) { order.push(best.pop()); }
+
+    while (!order.empty()) {
+        entry e = order.pop();
+        if (!processor(m_nodes + e.node, sqrtf(e.distance))) return;
+    }
+}
+
+template <typename F>
+void abtree::sweep(const bbox2 &box, const vec2 &displacement, F &&processor) {
+    if (m_root == abt::null) return;
+
+    struct entry {
+        int   node;
+        float fraction; //! time of entry into the node box
+
+        //! reversed, so that the max queue pops the earliest entry
+        bool operator<(const entry &other) const {
+            return fraction > other.fraction;
+        }
+    };
+
+    const vec2 origin = centerOf(box);
+    const vec2 extent = (box.upper - box.lower) * 0.5f;
+    const vec2 invdir = abt::inverseOf(displacement);
+
+    //! Minkowski sum: the center of box against the grown node box
+    auto cast = [&](int index, float &fraction) {
+        bbox2 grown;
+        grown.lower = m_hot[index].box.lower - extent;
+        grown.upper = m_hot[index].box.upper + extent;
+        return abt::raycast(grown, origin, invdir, 1.0f, fraction);
+    };
+
+    abt::queue<entry> queue;
+
+    float fraction;
+    if (cast(m_root, fraction)) { queue.push({m_root, fraction}); }
+
+    while (!queue.empty()) {
+        entry               top  = queue.pop();
+        const abt::hotnode &node = m_hot[top.node];
+
+        if (node.left == abt::null) {
+            if (!processor(m_nodes + top.node, top.fraction)) return;
+            continue;
+        }
+
+        if (cast(node.left, fraction)) { queue.push({node.left, fraction}); }
+        if (cast(node.right, fraction)) { queue.push({node.right, fraction}); }
+    }
+}
+
+template <int Order, typename F>
+void abtree::traverse(F &&visit) {
+    static_assert(
+        Order == abt::PREORDER || Order == abt::INORDER
+            || Order == abt::POSTORDER,
+        "lspe::abtree::traverse expects PREORDER, INORDER or POSTORDER.");
+
+    if (m_root == abt::null) return;
+
+    //! a non-negative entry is a node to expand while ~index marks
+    //! a node whose visit is deferred after (part of) its subtree
+    abt::stack<> stack;
+    stack.push(m_root);
+
+    while (!stack.empty()) {
+        int index = stack.pop();
+
+        if (index >= 0) {
+            const abt::node *node = m_nodes + index;
+            if (Order == abt::PREORDER) {
+                if (!visit(node)) continue;
+                if (node->isLeaf()) continue;
+                stack.push(node->right);
+                stack.push(node->left);
+            } else if (node->isLeaf()) {
+                visit(node);
+            } else if (Order == abt::INORDER) {
+                stack.push(node->right);
+                stack.push(~index);
+                stack.push(node->left);
+            } else {
+                stack.push(~index);
+                stack.push(node->right);
+                stack.push(node->left);
+            }
+        } else {
+            const abt::node *node = m_nodes + ~index;
+            bool shouldSkip = !visit(node);
+            if (Order == abt::INORDER && shouldSkip) {
+                stack.pop(); //! drop the pending right subtree
+            }
+        }
+    }
+}
+
+}; // namespace lspe
@@ -0,0 +1,181 @@
+#pragma once
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: Quantized AABB Tree
+ *
+ *  @brief: compact read-only snapshot of abtree with 16-bit bounds
+ *
+ *  @NOTES: a node keeps the boxes of both children as 16-bit offsets
+ *          relative to its own box, so only the root box is in float
+ *          bounds are rounded outward, thus results of a query are
+ *          always a superset of the ones given by the source tree
+ *          a node takes 24 bytes and leaves need no node at all
+ *******************************/
+
+#include "../lspe/base/base.h"
+#include "../lspe/base/vec.h"
+#include "../lspe/bbox.h"
+#include "../lspe/abt.h"
+
+namespace lspe {
+
+class abtree16;
+
+namespace abt16 {
+
+//! fnvisit of the snapshot, called with the proxy id of the source tree
+//! return false to stop the query
+typedef bool (*fnvisit)(int id, void *userdata, void *extra);
+
+static const int quantum = 65535; //! number of steps over a node box
+
+struct node {
+    uint16_t lowerx[2]; //! boxes of the left [0] and right [1] child
+    uint16_t lowery[2]; //! quantized inside the box of this node
+    uint16_t upperx[2];
+    uint16_t uppery[2];
+
+    int child[2]; //! >= 0: index of the child node in the snapshot
+                  //! < 0: ~index of the leaf in the leaf array
+};
+
+struct leaf {
+    int   id;       //! proxy id in the source abtree
+    void *userdata; //! userdata of the proxy
+};
+
+//! decode the child box k of node inside its parent box
+//! shared by the build and the queries so both see the same floats
+static inline bbox2 decode(const node &e, int k, const bbox2 &box);
+
+}; // namespace abt16
+
+class abtree16 {
+public:
+    abtree16();
+    ~abtree16();
+
+    abtree16(const abtree16 &)            = delete;
+    abtree16 &operator=(const abtree16 &) = delete;
+
+    void build(const abtree &tree);
+    //! quantize the whole tree into the compact snapshot
+    //! memory of the previous snapshot is reused
+
+    void clear();
+
+    int nodeCount() const;
+    int leafCount() const;
+
+    size_t memoryUsage() const; //! bytes used by nodes and leaves
+
+    void query(
+        abt16::fnvisit processor, const bbox2 &box, void *extra = nullptr);
+    void query(
+        abt16::fnvisit processor, const vec2 &point, void *extra = nullptr);
+
+    template <typename F>
+    void query(const bbox2 &box, F &&processor);
+    //! call processor(int id, void *userdata) for each leaf overlapping box
+
+    template <typename F>
+    void query(const vec2 &point, F &&processor);
+    //! call processor(int id, void *userdata) for each leaf containing point
+
+private:
+    int allocateNode(); //! return index of a new node
+    int allocateLeaf(); //! return index of a new leaf
+
+    void quantize(int node, int k, const bbox2 &box, const bbox2 &parent);
+    //! store box as child k of node, conservatively rounded outward
+
+    template <typename T, typename F>
+    void walk(const T &test, F &&processor);
+    //! shared traversal of both queries, test(const bbox2 &) -> bool
+
+    struct entry {
+        int   node;
+        bbox2 box; //! decoded box of the node
+    };
+
+    bbox2 m_box; //! box of the root in float
+
+    abt16::node *m_nodes;
+    int          m_nnode;
+    int          m_nodeCapacity;
+
+    abt16::leaf *m_leaves;
+    int          m_nleaf;
+    int          m_leafCapacity;
+};
+
+}; // namespace lspe
+
+namespace lspe {
+
+namespace abt16 {
+
+bbox2 decode(const node &e, int k, const bbox2 &box) {
+    //! the end points are exact so a child touching the border of its
+    //! parent never loses precision
+    auto lerp = [](float lower, float upper, uint16_t q) {
+        if (q == 0) return lower;
+        if (q == quantum) return upper;
+        return lower + (upper - lower) * (float(q) / quantum);
+    };
+
+    bbox2 child;
+    child.lower.x = lerp(box.lower.x, box.upper.x, e.lowerx[k]);
+    child.lower.y = lerp(box.lower.y, box.upper.y, e.lowery[k]);
+    child.upper.x = lerp(box.lower.x, box.upper.x, e.upperx[k]);
+    child.upper.y = lerp(box.lower.y, box.upper.y, e.uppery[k]);
+    return child;
+}
+
+}; // namespace abt16
+
+template <typename T, typename F>
+void abtree16::walk(const T &test, F &&processor) {
+    if (m_nleaf == 0 || !test(m_box)) return;
+
+    if (m_nnode == 0) { //! a single leaf
+        processor(m_leaves[0].id, m_leaves[0].userdata);
+        return;
+    }
+
+    abt::stack<entry> stack;
+    stack.push({0, m_box});
+
+    while (!stack.empty()) {
+        entry              top  = stack.pop();
+        const abt16::node &node = m_nodes[top.node];
+
+        //! walk the right child first so that the left one is popped first
+        for (int k = 1; k >= 0; --k) {
+            bbox2 box = abt16::decode(node, k, top.box);
+            if (!test(box)) continue;
+
+            int child = node.child[k];
+            if (child >= 0) {
+                stack.push({child, box});
+            } else {
+                const abt16::leaf &leaf = m_leaves[~child];
+                if (!processor(leaf.id, leaf.userdata)) return;
+            }
+        }
+    }
+}
+
+template <typename F>
+void abtree16::query(const bbox2 &box, F &&processor) {
+    walk([&box](const bbox2 &e) { return overlap(e, box); }, processor);
+}
+
+template <typename F>
+void abtree16::query(const vec2 &point, F &&processor) {
+    walk([&point](const bbox2 &e) { return contain(e, point); }, processor);
+}
+
+}; // namespace lspe
@@ -0,0 +1,165 @@
+#pragma once
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: Collapsed 4-wide AABB Tree
+ *
+ *  @brief: read-only snapshot of abtree for read-heavy queries
+ *
+ *  @NOTES: every node keeps the boxes of up to 4 children as SoA lanes
+ *          so one SIMD compare tests all of them at once
+ *          the snapshot doesn't follow later changes of the source tree
+ *          rebuild it (e.g. once per step) before querying
+ *******************************/
+
+#include "../lspe/base/base.h"
+#include "../lspe/base/vec.h"
+#include "../lspe/base/simd.h"
+#include "../lspe/bbox.h"
+#include "../lspe/abt.h"
+
+namespace lspe {
+
+namespace abt4 {
+
+//! fnvisit of the snapshot, called with the proxy id of the source tree
+//! return false to stop the query
+typedef bool (*fnvisit)(int id, void *userdata, void *extra);
+
+struct node {
+    float lowerx[4]; //! child boxes stored as SoA lanes
+    float lowery[4]; //! lanes [count, 4) are unused, they hold an empty
+    float upperx[4]; //! (inverted) box but are masked out by walk() since
+    float uppery[4]; //! an unbounded query box passes even that one
+
+    int child[4]; //! >= 0: index of the child node in the snapshot
+                  //! < 0: ~index of the leaf in the leaf array
+    int count;    //! number of used lanes
+};
+
+struct leaf {
+    int   id;       //! proxy id in the source abtree
+    void *userdata; //! userdata of the proxy
+};
+
+}; // namespace abt4
+
+class abtree4 {
+public:
+    abtree4();
+    ~abtree4();
+
+    abtree4(const abtree4 &)            = delete;
+    abtree4 &operator=(const abtree4 &) = delete;
+
+    void build(const abtree &tree);
+    //! collapse the binary tree into the 4-wide snapshot
+    //! memory of the previous snapshot is reused
+
+    void clear();
+
+    int nodeCount() const;
+    int leafCount() const;
+
+    void
+        query(abt4::fnvisit processor, const bbox2 &box, void *extra = nullptr);
+    void query(
+        abt4::fnvisit processor, const vec2 &point, void *extra = nullptr);
+
+    template <typename F>
+    void query(const bbox2 &box, F &&processor);
+    //! call processor(int id, void *userdata) for each leaf overlapping box
+
+    template <typename F>
+    void query(const vec2 &point, F &&processor);
+    //! call processor(int id, void *userdata) for each leaf containing point
+
+private:
+    int allocateNode(); //! return index of a new node
+    int allocateLeaf(); //! return index of a new leaf
+
+    template <typename T, typename F>
+    void walk(const T &test, F &&processor);
+    //! shared traversal of both queries
+    //! test(const abt4::node &) returns the bit mask of the hit lanes
+
+    abt4::node *m_nodes;
+    int         m_nnode;
+    int         m_nodeCapacity;
+
+    abt4::leaf *m_leaves;
+    int         m_nleaf;
+    int         m_leafCapacity;
+};
+
+}; // namespace lspe
+
+namespace lspe {
+
+template <typename T, typename F>
+void abtree4::walk(const T &test, F &&processor) {
+    if (m_nnode == 0) return;
+
+    abt::stack<> stack;
+    stack.push(0);
+
+    while (!stack.empty()) {
+        const abt4::node &node = m_nodes[stack.pop()];
+
+        int mask = test(node) & ((1 << node.count) - 1);
+        if (mask == 0) continue;
+
+        //! walk lanes in reverse so that lane 0 is popped first
+        for (int i = 3; i >= 0; --i) {
+            if (!(mask & (1 << i))) continue;
+            int child = node.child[i];
+            if (child >= 0) {
+                stack.push(child);
+            } else {
+                const abt4::leaf &leaf = m_leaves[~child];
+                if (!processor(leaf.id, leaf.userdata)) return;
+            }
+        }
+    }
+}
+
+template <typename F>
+void abtree4::query(const bbox2 &box, F &&processor) {
+    using namespace simd;
+
+    const f32x4 qlx = splat(box.lower.x);
+    const f32x4 qly = splat(box.lower.y);
+    const f32x4 qux = splat(box.upper.x);
+    const f32x4 quy = splat(box.upper.y);
+
+    walk(
+        [&](const abt4::node &node) {
+            f32x4 hit = cmple(load(node.lowerx), qux)
+                      & cmple(load(node.lowery), quy)
+                      & cmple(qlx, load(node.upperx))
+                      & cmple(qly, load(node.uppery));
+            return movemask(hit);
+        },
+        processor);
+}
+
+template <typename F>
+void abtree4::query(const vec2 &point, F &&processor) {
+    using namespace simd;
+
+    const f32x4 px = splat(point.x);
+    const f32x4 py = splat(point.y);
+
+    walk(
+        [&](const abt4::node &node) {
+            f32x4 hit = cmple(load(node.lowerx), px)
+                      & cmple(load(node.lowery), py)
+                      & cmple(px, load(node.upperx))
+                      & cmple(py, load(node.uppery));
+            return movemask(hit);
+        },
+        processor);
+}
+
+}; // namespace lspe
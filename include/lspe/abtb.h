@@ -0,0 +1,215 @@
+#pragma once
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: Bucketed AABB Tree
+ *
+ *  @brief: dynamic abtree whose leaves hold buckets of proxies
+ *
+ *  @NOTES: for huge numbers of tiny objects (debris, particles)
+ *          a leaf keeps up to abtb::capacity proxies as SoA lanes which
+ *          are tested linearly with SIMD, so the tree has about
+ *          capacity times fewer nodes and is much shallower
+ *          a full bucket is split along its longest axis, a bucket
+ *          running low is merged into its sibling bucket
+ *******************************/
+
+#include "../lspe/base/base.h"
+#include "../lspe/base/vec.h"
+#include "../lspe/base/simd.h"
+#include "../lspe/bbox.h"
+#include "../lspe/abt.h"
+
+namespace lspe {
+
+namespace abtb {
+
+//! fnvisit of the bucketed tree, called with the proxy id
+//! return false to stop the query
+typedef bool (*fnvisit)(int id, void *userdata, void *extra);
+
+static const int capacity = 8; //! proxies per bucket, a multiple of 4
+
+struct bucket {
+    float lowerx[capacity]; //! fatten boxes of the proxies as SoA lanes
+    float lowery[capacity]; //! lanes [count, capacity) are unused, they
+    float upperx[capacity]; //! hold an empty (inverted) box but are masked
+    float uppery[capacity]; //! out by walk() since an unbounded query box
+                            //! passes even that one
+
+    int proxy[capacity]; //! proxy id of each lane
+
+    int leaf;  //! leaf of the bucket in the inner abtree
+               //! next free bucket when the bucket is free
+    int count; //! number of used lanes
+};
+
+struct proxy {
+    void *userdata;
+    int   bucket; //! bucket holding the proxy, next free proxy when free
+    int   lane;   //! lane of the proxy in the bucket, -1 when free
+};
+
+}; // namespace abtb
+
+class abtreeb {
+public:
+    abtreeb();
+    ~abtreeb();
+
+    abtreeb(const abtreeb &)            = delete;
+    abtreeb &operator=(const abtreeb &) = delete;
+
+    void setExtension(float r);
+    //! set extension of the proxy boxes, defaultly 2 (meters)
+
+    int addObject(const bbox2 &box, void *userdata);
+    //! add a new object with a bounding box, return its proxy id
+
+    void delObject(int id);
+    //! delete the object by id (given by addObject())
+
+    bool moveObject(int id, const bbox2 &box, const vec2 &displacement);
+    //! same as abtree::moveObject()
+    //! return true if the proxy had to leave its fatten box
+
+    bbox2 getFattenBBox(int id) const;
+    void *getUserdata(int id) const;
+
+    int objectCount() const; //! number of proxies
+    int bucketCount() const; //! number of buckets (leaves of the tree)
+    int nodeCount() const;   //! number of nodes of the inner tree
+
+    void
+        query(abtb::fnvisit processor, const bbox2 &box, void *extra = nullptr);
+    void query(
+        abtb::fnvisit processor, const vec2 &point, void *extra = nullptr);
+
+    template <typename F>
+    void query(const bbox2 &box, F &&processor);
+    //! call processor(int id, void *userdata) for each proxy overlapping box
+    //! return false from processor to stop the query
+
+    template <typename F>
+    void query(const vec2 &point, F &&processor);
+    //! call processor(int id, void *userdata) for each proxy containing point
+
+private:
+    int  allocateBucket(); //! return index of a new (empty) bucket
+    void freeBucket(int bucket);
+    int  allocateProxy(); //! return id of a new proxy
+    void freeProxy(int id);
+
+    bbox2 fatten(const bbox2 &box, const vec2 &displacement) const;
+    //! fatten box by m_extension and stretch it along the displacement
+
+    bbox2 boundOf(int bucket) const; //! union of the boxes in the bucket
+    int   bucketOf(int leaf) const;  //! bucket of a leaf of m_tree
+
+    void insert(int id, const bbox2 &box); //! put the proxy into a bucket
+    void remove(int id); //! take the proxy out of its bucket
+                         //! empty buckets are dropped, low ones merged
+
+    void place(int bucket, int id, const bbox2 &box); //! append a lane
+    void split(int bucket, int id, const bbox2 &box); //! split a full
+                                                      //! bucket while
+                                                      //! adding the proxy
+    void attach(int bucket); //! add a leaf for the bucket to m_tree
+    void refit(int bucket);  //! fit the leaf of the bucket to its lanes
+    void shrink(int bucket); //! refit() only if the leaf is much larger
+
+    template <typename T, typename F>
+    void walk(const bbox2 &bound, const T &test, F &&processor);
+    //! visit leaves overlapping bound and test their lanes
+    //! test(const abtb::bucket &) returns the bit mask of the hit lanes
+
+    abtree m_tree; //! leaves are buckets
+
+    abtb::bucket *m_buckets;
+    int           m_bucketCapacity;
+    int           m_freebucket; //! root of the free list of buckets
+    int           m_nbucket;
+
+    abtb::proxy *m_proxies;
+    int          m_proxyCapacity;
+    int          m_freeproxy; //! root of the free list of proxies
+    int          m_nproxy;
+
+    int *m_leafBuckets; //! bucket of each leaf, indexed like the node
+                        //! pool of m_tree so the nodes stay untouched
+    int  m_leafCapacity;
+
+    float m_extension; //! bounding box extension of the proxies
+};
+
+}; // namespace lspe
+
+namespace lspe {
+
+template <typename T, typename F>
+void abtreeb::walk(const bbox2 &bound, const T &test, F &&processor) {
+    const abt::node *nodes = m_tree.m_nodes;
+    m_tree.query(bound, [&](const abt::node *node) {
+        const abtb::bucket &bucket = m_buckets[m_leafBuckets[node - nodes]];
+
+        int mask = test(bucket) & ((1 << bucket.count) - 1);
+        while (mask != 0) {
+            int lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            int id = bucket.proxy[lane];
+            if (!processor(id, m_proxies[id].userdata)) return false;
+        }
+
+        return true;
+    });
+}
+
+template <typename F>
+void abtreeb::query(const bbox2 &box, F &&processor) {
+    using namespace simd;
+
+    const f32x4 qlx = splat(box.lower.x);
+    const f32x4 qly = splat(box.lower.y);
+    const f32x4 qux = splat(box.upper.x);
+    const f32x4 quy = splat(box.upper.y);
+
+    auto test = [&](const abtb::bucket &bucket) {
+        int mask = 0;
+        for (int i = 0; i < abtb::capacity; i += 4) {
+            f32x4 hit = cmple(load(bucket.lowerx + i), qux)
+                      & cmple(load(bucket.lowery + i), quy)
+                      & cmple(qlx, load(bucket.upperx + i))
+                      & cmple(qly, load(bucket.uppery + i));
+            mask |= movemask(hit) << i;
+        }
+        return mask;
+    };
+
+    walk(box, test, processor);
+}
+
+template <typename F>
+void abtreeb::query(const vec2 &point, F &&processor) {
+    using namespace simd;
+
+    const f32x4 px = splat(point.x);
+    const f32x4 py = splat(point.y);
+
+    auto test = [&](const abtb::bucket &bucket) {
+        int mask = 0;
+        for (int i = 0; i < abtb::capacity; i += 4) {
+            f32x4 hit = cmple(load(bucket.lowerx + i), px)
+                      & cmple(load(bucket.lowery + i), py)
+                      & cmple(px, load(bucket.upperx + i))
+                      & cmple(py, load(bucket.uppery + i));
+            mask |= movemask(hit) << i;
+        }
+        return mask;
+    };
+
+    walk({point, point}, test, processor);
+}
+
+}; // namespace lspe
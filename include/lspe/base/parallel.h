@@ -0,0 +1,112 @@
+#pragma once
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: parallelFor, ThreadPool
+ *
+ *  @brief: fork-join loops over contiguous chunks
+ *
+ *  @NOTES: parallelFor() spawns its threads per call and joins them
+ *          before returning, so it suits coarse one-off work (builds)
+ *          ThreadPool keeps its threads parked between calls, so work
+ *          repeated every step doesn't pay the thread creation
+ *******************************/
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "../base/base.h"
+
+namespace lspe {
+
+//! run fn(begin, end, worker) over [0, n) split into contiguous chunks
+//! of at least minChunk items (don't wake a thread for less work)
+//! worker is in [0, threads)
+//! the calling thread takes the first chunk itself
+template <typename F>
+static void parallelFor(int n, int threads, F &&fn, int minChunk = 4096) {
+    int workers = max(1, min(threads, (n + minChunk - 1) / minChunk));
+    if (workers == 1) {
+        fn(0, n, 0);
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+
+    int chunk = (n + workers - 1) / workers;
+    for (int w = 1; w < workers; ++w) {
+        int begin = min(n, w * chunk);
+        int end   = min(n, begin + chunk);
+        pool.emplace_back([&fn, begin, end, w] { fn(begin, end, w); });
+    }
+
+    fn(0, min(n, chunk), 0);
+    for (auto &e : pool) { e.join(); }
+}
+
+class ThreadPool {
+public:
+    ThreadPool();
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &)            = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void resize(int threads);
+    //! number of threads including the caller, 1 releases all workers
+    int size() const;
+
+    template <typename F>
+    void run(int n, F &&fn, int minChunk = 4096);
+    //! parallelFor() on the threads of the pool, same chunks and workers
+
+private:
+    typedef void (*fntask)(void *task, int begin, int end, int worker);
+
+    void dispatch(fntask fn, void *task, int n, int workers);
+    //! hand the chunks [1, workers) out, run chunk 0 and wait for all
+
+    void work(int worker, uint32_t generation); //! loop of a worker
+
+    std::vector<std::thread> m_threads; //! workers 1 .. size() - 1
+    std::mutex               m_mutex;
+    std::condition_variable  m_wake; //! a new task or quit
+    std::condition_variable  m_done; //! the last chunk of a task finished
+
+    fntask m_fn; //! current task
+    void  *m_task;
+    int    m_n;
+    int    m_chunk;
+    int    m_workers; //! workers of the current task
+
+    int      m_pending;    //! chunks of the current task still running
+    uint32_t m_generation; //! counts the tasks
+    bool     m_quit;
+};
+
+}; // namespace lspe
+
+namespace lspe {
+
+template <typename F>
+void ThreadPool::run(int n, F &&fn, int minChunk) {
+    typedef typename std::remove_reference<F>::type task;
+
+    int workers = max(1, min(size(), (n + minChunk - 1) / minChunk));
+    if (workers == 1) {
+        fn(0, n, 0);
+        return;
+    }
+
+    auto call = [](void *fn, int begin, int end, int worker) {
+        (*(task *)fn)(begin, end, worker);
+    };
+    dispatch(call, (void *)&fn, n, workers);
+}
+
+}; // namespace lspe
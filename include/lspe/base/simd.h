@@ -0,0 +1,220 @@
+#pragma once
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: f32x4
+ *
+ *  @brief: 4-lane vector of built-in type float
+ *
+ *  @NOTES: backed by SSE when the target supports it
+ *          otherwise falls back to plain scalar lanes
+ *          LSPE_SIMD_SSE is defined when SSE is in use
+ *******************************/
+
+#include "../base/base.h"
+
+#if defined(__SSE__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LSPE_SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace lspe {
+
+namespace simd {
+
+struct f32x4;
+
+static inline f32x4 load(const float *p); //! p needn't be aligned
+static inline f32x4 splat(float x);
+static inline void  store(float *p, const f32x4 &a);
+
+static inline f32x4 operator+(const f32x4 &a, const f32x4 &b);
+static inline f32x4 operator-(const f32x4 &a, const f32x4 &b);
+static inline f32x4 operator*(const f32x4 &a, const f32x4 &b);
+
+static inline f32x4 min(const f32x4 &a, const f32x4 &b);
+static inline f32x4 max(const f32x4 &a, const f32x4 &b);
+
+//! lane-wise comparison, each lane of the result is all-ones or all-zeros
+static inline f32x4 cmple(const f32x4 &a, const f32x4 &b);
+static inline f32x4 cmplt(const f32x4 &a, const f32x4 &b);
+
+static inline f32x4 operator&(const f32x4 &a, const f32x4 &b);
+static inline f32x4 operator|(const f32x4 &a, const f32x4 &b);
+
+//! lane-wise mask ? a : b, mask must be a comparison result
+static inline f32x4 select(const f32x4 &mask, const f32x4 &a, const f32x4 &b);
+
+//! collect the sign bits of a comparison result, lane i -> bit i
+static inline int movemask(const f32x4 &a);
+
+struct f32x4 {
+#ifdef LSPE_SIMD_SSE
+    __m128 v;
+#else
+    float v[4];
+#endif
+};
+
+}; // namespace simd
+
+}; // namespace lspe
+
+namespace lspe {
+
+namespace simd {
+
+#ifdef LSPE_SIMD_SSE
+
+f32x4 load(const float *p) {
+    return {_mm_loadu_ps(p)};
+}
+
+f32x4 splat(float x) {
+    return {_mm_set1_ps(x)};
+}
+
+void store(float *p, const f32x4 &a) {
+    _mm_storeu_ps(p, a.v);
+}
+
+f32x4 operator+(const f32x4 &a, const f32x4 &b) {
+    return {_mm_add_ps(a.v, b.v)};
+}
+
+f32x4 operator-(const f32x4 &a, const f32x4 &b) {
+    return {_mm_sub_ps(a.v, b.v)};
+}
+
+f32x4 operator*(const f32x4 &a, const f32x4 &b) {
+    return {_mm_mul_ps(a.v, b.v)};
+}
+
+f32x4 min(const f32x4 &a, const f32x4 &b) {
+    return {_mm_min_ps(a.v, b.v)};
+}
+
+f32x4 max(const f32x4 &a, const f32x4 &b) {
+    return {_mm_max_ps(a.v, b.v)};
+}
+
+f32x4 cmple(const f32x4 &a, const f32x4 &b) {
+    return {_mm_cmple_ps(a.v, b.v)};
+}
+
+f32x4 cmplt(const f32x4 &a, const f32x4 &b) {
+    return {_mm_cmplt_ps(a.v, b.v)};
+}
+
+f32x4 operator&(const f32x4 &a, const f32x4 &b) {
+    return {_mm_and_ps(a.v, b.v)};
+}
+
+f32x4 operator|(const f32x4 &a, const f32x4 &b) {
+    return {_mm_or_ps(a.v, b.v)};
+}
+
+f32x4 select(const f32x4 &mask, const f32x4 &a, const f32x4 &b) {
+    return {_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v))};
+}
+
+int movemask(const f32x4 &a) {
+    return _mm_movemask_ps(a.v);
+}
+
+#else
+
+f32x4 load(const float *p) {
+    return {
+        {p[0], p[1], p[2], p[3]}
+    };
+}
+
+f32x4 splat(float x) {
+    return {
+        {x, x, x, x}
+    };
+}
+
+void store(float *p, const f32x4 &a) {
+    for (int i = 0; i < 4; ++i) { p[i] = a.v[i]; }
+}
+
+f32x4 operator+(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = a.v[i] + b.v[i]; }
+    return c;
+}
+
+f32x4 operator-(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = a.v[i] - b.v[i]; }
+    return c;
+}
+
+f32x4 operator*(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = a.v[i] * b.v[i]; }
+    return c;
+}
+
+f32x4 min(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; }
+    return c;
+}
+
+f32x4 max(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; }
+    return c;
+}
+
+//! scalar lanes encode a true comparison as -1.0f, whose sign bit is set
+f32x4 cmple(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = a.v[i] <= b.v[i] ? -1.0f : 0.0f; }
+    return c;
+}
+
+f32x4 cmplt(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = a.v[i] < b.v[i] ? -1.0f : 0.0f; }
+    return c;
+}
+
+f32x4 operator&(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) {
+        c.v[i] = a.v[i] < 0.0f && b.v[i] < 0.0f ? -1.0f : 0.0f;
+    }
+    return c;
+}
+
+f32x4 operator|(const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) {
+        c.v[i] = a.v[i] < 0.0f || b.v[i] < 0.0f ? -1.0f : 0.0f;
+    }
+    return c;
+}
+
+f32x4 select(const f32x4 &mask, const f32x4 &a, const f32x4 &b) {
+    f32x4 c;
+    for (int i = 0; i < 4; ++i) { c.v[i] = mask.v[i] < 0.0f ? a.v[i] : b.v[i]; }
+    return c;
+}
+
+int movemask(const f32x4 &a) {
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) { mask |= (a.v[i] < 0.0f) << i; }
+    return mask;
+}
+
+#endif
+
+}; // namespace simd
+
+}; // namespace lspe
@@ -9,6 +9,7 @@
  *
  *  @NOTES: bbox2::lower indicates left-bottom
  *          bbox2::upper indicates right-up
+ *          obb2 is the oriented version, obb2::axis must be normalized
  *******************************/
 
 #include "../lspe/base/base.h"
@@ -17,22 +18,61 @@
 namespace lspe {
 
 struct bbox2;
+struct obb2;
 
 struct bbox2 {
     vec2 lower;
     vec2 upper;
 };
 
+struct obb2 {
+    vec2 center;
+    vec2 extent; //! half size along the local axes
+    vec2 axis;   //! unit direction of the local x axis
+                 //! the local y axis is axis rotated by 90 degrees
+};
+
 vec2  centerOf(const bbox2 &a);
 float perimeterOf(const bbox2 &a);
 float areaOf(const bbox2 &a);
 
+bbox2 bboxOf(const obb2 &a);
+
 bbox2 unionOf(const bbox2 &a, const bbox2 &b);
 bbox2 intersectionOf(const bbox2 &a, const bbox2 &b);
 
-bool overlap(const bbox2 &a, const bbox2 &b);
+//! hot predicates of abtree traversal, defined inline below
+static inline bool overlap(const bbox2 &a, const bbox2 &b);
+
+static inline bool contain(const bbox2 &a, const bbox2 &b);
+static inline bool contain(const bbox2 &a, const vec2 &b);
+
+//! squared distance from b to the box a, 0 if a contains b
+static inline float sqrDistanceOf(const bbox2 &a, const vec2 &b);
+
+}; // namespace lspe
+
+namespace lspe {
+
+bool overlap(const bbox2 &a, const bbox2 &b) {
+    return a.lower.x <= b.upper.x && a.lower.y <= b.upper.y
+        && b.lower.x <= a.upper.x && b.lower.y <= a.upper.y;
+}
+
+bool contain(const bbox2 &a, const bbox2 &b) {
+    return a.lower.x <= b.lower.x && a.lower.y <= b.lower.y
+        && a.upper.x >= b.upper.x && a.upper.y >= b.upper.y;
+}
+
+bool contain(const bbox2 &a, const vec2 &b) {
+    return b.x >= a.lower.x && b.x <= a.upper.x && b.y >= a.lower.y
+        && b.y <= a.upper.y;
+}
 
-bool contain(const bbox2 &a, const bbox2 &b);
-bool contain(const bbox2 &a, const vec2 &b);
+float sqrDistanceOf(const bbox2 &a, const vec2 &b) {
+    float dx = max(max(a.lower.x - b.x, b.x - a.upper.x), 0.0f);
+    float dy = max(max(a.lower.y - b.y, b.y - a.upper.y), 0.0f);
+    return dx * dx + dy * dy;
+}
 
 }; // namespace lspe
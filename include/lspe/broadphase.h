@@ -1,8 +1,12 @@
 #pragma once
 
+#include <vector>
+
 #include "../lspe/base/base.h"
+#include "../lspe/base/parallel.h"
 #include "../lspe/base/vec.h"
 #include "../lspe/abt.h"
+#include "../lspe/abt4.h"
 
 namespace lspe {
 
@@ -10,11 +14,185 @@ namespace broadphase {
 
 typedef void (*fnnewpair)(void *firstData, void *secondData, void *extra);
 
+enum class PairEvent {
+    eBegin, //! the fatten boxes started to overlap in this step
+    eStay,  //! the pair already existed in the last step
+    eEnd,   //! the fatten boxes separated or an object was deleted
+};
+
 struct IntPair {
-    int first;
-    int second;
+    int       first; //! first < second
+    int       second;
+    PairEvent event;
+    void     *userdata; //! attached by PairCache::setUserdata(), null for
+                        //! a new pair, still valid for an ended pair
+};
+
+//! a reported node with its distance or fraction, ordered so that
+//! abt::queue pops the smallest value first
+struct candidate {
+    const abt::node *node;
+    float            value;
+
+    bool operator<(const candidate &other) const {
+        return value > other.value;
+    }
+};
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @PairCache: persistent set of overlapping pairs
+ *
+ *  @brief: open-addressing hash table keyed by (min id, max id)
+ *
+ *  @NOTES: a step is prepare(), any number of add() and commit(),
+ *          commit() turns the table into one event per pair, so each
+ *          pair is reported once and a pair whose objects didn't move
+ *          is kept without any query
+ *          the userdata of a pair (e.g. a contact) rides along with its
+ *          events, so a narrowphase needs no lookup for staying pairs
+ *******************************/
+class PairCache {
+public:
+    PairCache();
+    ~PairCache();
+
+    PairCache(const PairCache &)            = delete;
+    PairCache &operator=(const PairCache &) = delete;
+
+    void prepare();
+    //! start a step, end the pairs given to remove() and removeIf()
+
+    void add(int first, int second);
+    //! report an overlap of the fatten boxes, duplicates are merged
+
+    template <typename F>
+    void commit(F &&moved);
+    //! finish the step, a pair not reported by add() ends if
+    //! bool moved(int id) holds for one of its objects (its fatten box
+    //! was changed) and stays otherwise
+
+    void remove(int id);
+    //! end all pairs of the object at the next prepare()
+
+    template <typename F>
+    void removeIf(F &&pred);
+    //! end all pairs for which bool pred(int first, int second) holds
+    //! at the next prepare()
+
+    void  setUserdata(int first, int second, void *userdata);
+    void *getUserdata(int first, int second) const;
+
+    const IntPair *getEvents(int *count) const;
+    //! events of the last step in table order
+
+    int pairCount() const; //! number of cached pairs
+
+private:
+    struct slot {
+        uint64_t key; //! keyOf(first, second), empty or tomb
+        void    *userdata;
+        uint32_t stamp; //! last step the pair was reported by add()
+        int32_t  state; //! fresh, doomed or zero
+    };
+
+    static const uint64_t empty = ~0ull;
+    static const uint64_t tomb  = ~0ull - 1;
+    //! no valid key has the upper half of a marker, which is abt::null
+
+    enum { fresh = 1, doomed = 2 };
+
+    static uint64_t keyOf(int first, int second);
+    static uint32_t hashOf(uint64_t key);
+
+    int  find(uint64_t key) const; //! slot of the key or -1
+    void rehash(int capacity);
+    void emit(const slot &pair, PairEvent event);
+    void kill(int index); //! emit the end event and bury the slot
+
+    slot *m_slots;
+    int   m_capacity; //! power of 2
+    int   m_count;
+    int   m_tombs;
+
+    IntPair *m_events;
+    int      m_eventCapacity;
+    int      m_eventCount;
+
+    int *m_dead; //! ids given to remove() since the last prepare()
+    int  m_deadCapacity;
+    int  m_deadCount;
+    int  m_doomed; //! slots marked by removeIf()
+
+    uint32_t m_stamp; //! current step
+};
+
+//! methods of broadphase::create()
+enum {
+    ABTREE, //! dynamic AABB tree (BroadPhase), general purpose
+    SAP,    //! sweep and prune (SweepAndPrune), wide and flat scenes
+    GRID    //! spatial hash grid (SpatialHash), many similar sizes
+};
+
+//! fnvisit of a backend, called with the object id
+//! return false to stop the query
+typedef bool (*fnvisit)(int id, void *userdata, void *extra);
+
+//! fnraycast of a backend, called with the object id
+//! the return value clips or terminates the ray like abt::fnraycast
+typedef float (*fnraycast)(
+    int id, void *userdata, float maxFraction, void *extra);
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @Backend: common interface of the broadphases
+ *
+ *  @brief: objects, pairs and spatial queries behind virtual calls
+ *
+ *  @NOTES: lets the backend be chosen at startup (see create()) for the
+ *          object distribution of the scene, specific settings and the
+ *          inlinable queries remain on the concrete classes
+ *******************************/
+class Backend {
+public:
+    virtual ~Backend() {}
+
+    virtual int  addObject(const bbox2 &box, void *userdata) = 0;
+    virtual void delObject(int id)                           = 0;
+    virtual void moveObject(
+        int id, const bbox2 &box, const vec2 &displacement) = 0;
+    virtual void moveObjects(
+        const int   *ids,
+        const bbox2 *boxes,
+        const vec2  *displacements,
+        int          n)                    = 0;
+    //! displacements is optional (nullptr means no displacement)
+    virtual void *getUserdata(int id) const = 0;
+
+    virtual void           updatePairs()               = 0;
+    virtual const IntPair *getPairs(int *count) const = 0;
+    //! pairs with their events, see PairCache
+
+    virtual void  setPairUserdata(int first, int second, void *userdata) = 0;
+    virtual void *getPairUserdata(int first, int second) const           = 0;
+
+    virtual void query(fnvisit processor, const bbox2 &box, void *extra) = 0;
+    //! objects whose box overlaps box
+
+    virtual void raycast(
+        fnraycast   processor,
+        const vec2 &origin,
+        const vec2 &dir,
+        float       maxFraction,
+        void       *extra) = 0;
+    //! objects whose box is hit by origin + t * dir, t in [0, maxFraction]
 };
 
+Backend *create(int method);
+//! new backend of the method (ABTREE, SAP or GRID), release it with delete
+
 }; // namespace broadphase
 
 /********************************
@@ -24,37 +202,195 @@ struct IntPair {
  *
  *  @brief: approximately an proxy of abtree
  *
- *  @NOTES:
+ *  @NOTES: objects live in one of two trees, the dynamic tree holds
+ *          moving objects and the static tree holds objects that are
+ *          rarely modified (level geometry), pairs are only generated
+ *          between a dynamic object and any other object
+ *          static ids are negative and never collide with dynamic ones
  *******************************/
-class BroadPhase {
+class BroadPhase : public broadphase::Backend {
     // public: friend BroadPhase::_query(const abt::node *node, void *extra);
 
 public:
     BroadPhase();
     ~BroadPhase();
 
-    int  addObject(const bbox2 &box, void *userdata);
-    void delObject(int id);
-    void moveObject(int id, const bbox2 &box, const vec2 &displacement);
+    int  addObject(const bbox2 &box, void *userdata) override;
+    void delObject(int id) override;
+    void moveObject(
+        int id, const bbox2 &box, const vec2 &displacement) override;
+    void moveObjects(
+        const int   *ids,
+        const bbox2 *boxes,
+        const vec2  *displacements,
+        int          n) override;
+    //! batch version of moveObject(), see abtree::moveObjects()
+    //! reinserted objects are buffered for the next updatePairs()
+
+    void refitObjects(const int *ids, const bbox2 *boxes, int n, int budget);
+    //! move n objects of a coherent group without any reinsertion
+    //! see abtree::refit(), all of them are buffered
+
+    void build(const bbox2 *boxes, void **userdata, int n, int *ids);
+    //! discard all objects and bulk load n objects (see abtree::build())
+    //! ids receives the id of each object, all of them are buffered
+
+    int addStaticObject(const bbox2 &box, void *userdata);
+    //! add an object to the static tree, static objects can't be moved
+    //! call rebuildStatic() after adding a series of them
+
+    void buildStatic(const bbox2 *boxes, void **userdata, int n, int *ids);
+    //! discard all static objects and bulk build the static tree
+
+    void rebuildStatic();
+    //! rebuild the static tree with SAH, e.g. once after loading a level
+
+    static bool isStatic(int id); //! whether id refers to a static object
+
+    int idOf(const abt::node *node) const;
+    //! object id of a node reported by query(), raycast(), nearest() or
+    //! sweep(), node->index is only unique inside the tree of the node
 
     void addMove(int id);
     void delMove(int id);
 
-    const broadphase::IntPair *getPairs(int *count) const;
-    void                       updatePairs();
+    const broadphase::IntPair *getPairs(int *count) const override;
+    void                       updatePairs() override;
+    //! updatePairs() reports every cached pair once with its event
+    //! (see broadphase::PairCache), getPairs() returns these events
+
+    void  setPairUserdata(int first, int second, void *userdata) override;
+    void *getPairUserdata(int first, int second) const override;
+    //! userdata of a pair, it is carried by all events of the pair
+
+    void optimize(int budget);
+    //! incremental tree optimization, see abtree::optimize()
+
+    void setMarginRange(float lower, float upper);
+    //! adaptive fatten margins of dynamic objects
+    //! see abtree::setMarginRange()
 
-    void *getUserdata(int id) const;
+    void setDualTraversalThreshold(float fraction);
+    //! updatePairs() switches from one query per buffered object to a
+    //! single tree-vs-tree self traversal (abtree::queryPairs()) when
+    //! the buffered objects exceed this fraction of all objects
+    //! defaultly 0.2, pass a value > 1 to disable the switch
+
+    void setThreads(int threads);
+    //! worker threads of updatePairs(), defaultly 1 (serial), 0 picks
+    //! the hardware concurrency
+    //! with more than one, the buffered objects are split among the
+    //! workers, which query the trees into their own pair buffers, the
+    //! buffers are then added to the cache in order, so the events are
+    //! the same for any number of threads
+    //! the self traversal (see setDualTraversalThreshold()) is serial
+    //! and not used then
+    //! the workers are parked between steps (see ThreadPool)
+
+    void *getUserdata(int id) const override;
+
+    void setCategory(int id, int32_t category);
+    //! category bit mask of the object for filtered queries
+    //! (see abtree::setCategory())
 
     void query(abt::fnvisit processor, const bbox2 &box, void *extra);
-    //! query function that calls abtree::query()
+    //! query function that calls abtree::query() of the dynamic tree only
+    //! node->index of a static proxy would collide with dynamic ids
+    //! spatial queries below cover both trees, see idOf()
+    void query(
+        broadphase::fnvisit processor,
+        const bbox2        &box,
+        void               *extra) override;
+    //! query() of the backend interface, reports object ids
     void traverse(
         abt::fnvisit processor, void *extra, int method = abt::PREORDER);
-    //! traverse abtree
+    //! traverse the dynamic abtree
+
+    template <typename T, typename F>
+    void query(const T &region, F &&processor);
+    //! inlinable version of query() taking bool(const abt::node *)
+    //! region is anything abtree::query() accepts, e.g. bbox2, vec2,
+    //! shape::Polygen (convex) or obb2
+
+    template <typename T, typename F>
+    void query(const T &region, int32_t mask, F &&processor);
+    //! filtered version of query(), only objects whose category
+    //! intersects mask are reported (region is bbox2 or vec2)
+
+    void raycast(
+        abt::fnraycast processor,
+        const vec2    &origin,
+        const vec2    &dir,
+        float          maxFraction,
+        void          *extra);
+    //! ray cast that calls abtree::raycast()
+    void raycast(
+        broadphase::fnraycast processor,
+        const vec2           &origin,
+        const vec2           &dir,
+        float                 maxFraction,
+        void                 *extra) override;
+    //! raycast() of the backend interface, reports object ids
+
+    template <typename F>
+    void raycast(
+        const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor);
+    //! inlinable version of raycast()
+    //! taking float(const abt::node *, float maxFraction)
+
+    void raycast(
+        abt::fnraybatch processor,
+        const vec2     *origins,
+        const vec2     *dirs,
+        const float    *maxFractions,
+        int             n,
+        void           *extra);
+    //! packet ray cast of n rays, see abtree::raycast()
+
+    template <typename F>
+    void raycast(
+        const vec2  *origins,
+        const vec2  *dirs,
+        const float *maxFractions,
+        int          n,
+        F          &&processor);
+    //! inlinable version of the packet raycast()
+
+    void nearest(
+        abt::fnnearest processor,
+        const vec2    &point,
+        int            k,
+        float          maxDistance,
+        void          *extra);
+    //! k nearest objects within maxDistance, see abtree::nearest()
+
+    template <typename F>
+    void nearest(const vec2 &point, int k, float maxDistance, F &&processor);
+    //! inlinable version of nearest()
+    //! taking bool(const abt::node *, float distance)
+
+    void sweep(
+        abt::fnsweep processor,
+        const bbox2 &box,
+        const vec2  &displacement,
+        void        *extra);
+    //! continuous collision candidates of a moving box
+    //! see abtree::sweep()
+
+    template <typename F>
+    void sweep(const bbox2 &box, const vec2 &displacement, F &&processor);
+    //! inlinable version of sweep()
+    //! taking bool(const abt::node *, float fraction)
+
+    void buildSnapshot(abtree4 &snapshot) const;
+    //! collapse the dynamic tree into a read-only 4-wide snapshot
+    //! for read-heavy queries, rebuild it after every step
 
 protected:
 
 private:
-    abtree tree;
+    abtree tree;       //! dynamic objects
+    abtree staticTree; //! static objects, ids encoded by staticIdOf()
 
     int queryId;
 
@@ -63,16 +399,214 @@ private:
     int  moveCapacity;
     int  moveCount;
 
-    //! buffered all test pairs
-    //! a pair is construct with (firstIndex, secondIndex)
-    //! and there always exists firstIndex > secondIndex
-    //! and some optimization can be applied
-    broadphase::IntPair *pairBuffer;
-    int                  pairCapacity;
-    int                  pairCount;
+    //! all overlapping pairs, kept across steps
+    broadphase::PairCache pairs;
 
-    static bool _query(const abt::node *node, void *extra);
+    float dualThreshold;
+
+    ThreadPool workers; //! threads of updatePairs(), see setThreads()
+
+    //! pairs found by each worker of the parallel updatePairs()
+    std::vector<std::vector<uint64_t>> pairBuffers;
+
+    void reserveMoves(int count); //! make room for count more moves
+    bool wasMoved(int id); //! whether the fatten box of the object changed
+
+    bool _query(const abt::node *node);
     //! query callback for abtree query
+
+    void queryParallel();
+    //! the queries of updatePairs() split among threads
+
+    static int staticIdOf(int index);
+    static int staticIndexOf(int id);
+    //! static ids are -index - 2, so that abt::null (-1) stays free
 };
 
 }; // namespace lspe
+
+namespace lspe {
+
+template <typename F>
+void broadphase::PairCache::commit(F &&moved) {
+    for (int i = 0; i < m_capacity; ++i) {
+        slot &pair = m_slots[i];
+        if (pair.key >= tomb) continue;
+
+        if (pair.stamp == m_stamp) {
+            emit(pair, pair.state == fresh ? PairEvent::eBegin
+                                           : PairEvent::eStay);
+            pair.state = 0;
+            continue;
+        }
+
+        //! the pair was not found again, the fatten boxes still overlap
+        //! unless one of them was changed
+        int first  = (int)(uint32_t)(pair.key >> 32);
+        int second = (int)(uint32_t)pair.key;
+        if (moved(first) || moved(second)) {
+            kill(i);
+        } else {
+            emit(pair, PairEvent::eStay);
+        }
+    }
+}
+
+template <typename F>
+void broadphase::PairCache::removeIf(F &&pred) {
+    for (int i = 0; i < m_capacity; ++i) {
+        slot &pair = m_slots[i];
+        if (pair.key >= tomb || pair.state == doomed) continue;
+
+        int first  = (int)(uint32_t)(pair.key >> 32);
+        int second = (int)(uint32_t)pair.key;
+        if (pred(first, second)) {
+            pair.state = doomed;
+            ++m_doomed;
+        }
+    }
+}
+
+inline bool BroadPhase::isStatic(int id) {
+    return id < abt::null;
+}
+
+inline int BroadPhase::staticIdOf(int index) {
+    return -index - 2;
+}
+
+inline int BroadPhase::staticIndexOf(int id) {
+    return -id - 2;
+}
+
+template <typename T, typename F>
+void BroadPhase::query(const T &region, F &&processor) {
+    bool go = true;
+    tree.query(region, [&processor, &go](const abt::node *node) {
+        return go = processor(node);
+    });
+    if (go) { staticTree.query(region, processor); }
+}
+
+template <typename T, typename F>
+void BroadPhase::query(const T &region, int32_t mask, F &&processor) {
+    bool go = true;
+    tree.query(region, mask, [&processor, &go](const abt::node *node) {
+        return go = processor(node);
+    });
+    if (go) { staticTree.query(region, mask, processor); }
+}
+
+template <typename F>
+void BroadPhase::raycast(
+    const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor) {
+    //! the static tree goes first, its large shapes usually clip the ray
+    //! early and the dynamic tree is then cast with the shorter ray
+    auto visitor = [&processor, &maxFraction](
+                       const abt::node *node, float fraction) {
+        float value = processor(node, fraction);
+        maxFraction = value <= 0.0f ? 0.0f : min(maxFraction, value);
+        return value;
+    };
+
+    staticTree.raycast(origin, dir, maxFraction, visitor);
+    if (maxFraction > 0.0f) { tree.raycast(origin, dir, maxFraction, visitor); }
+}
+
+template <typename F>
+void BroadPhase::raycast(
+    const vec2  *origins,
+    const vec2  *dirs,
+    const float *maxFractions,
+    int          n,
+    F          &&processor) {
+    //! both trees are cast packet by packet, so that the clipped
+    //! fractions of the static tree carry over to the dynamic tree
+    for (int base = 0; base < n; base += 4) {
+        int   count = min(4, n - base);
+        float limits[4];
+        for (int i = 0; i < count; ++i) { limits[i] = maxFractions[base + i]; }
+
+        auto visitor = [&processor, &limits, base](
+                           const abt::node *node, int ray, float fraction) {
+            float value  = processor(node, base + ray, fraction);
+            //! a negative fraction disables the ray in the next tree
+            limits[ray] = value <= 0.0f ? -1.0f : min(limits[ray], value);
+            return value;
+        };
+
+        staticTree.raycast(origins + base, dirs + base, limits, count, visitor);
+        tree.raycast(origins + base, dirs + base, limits, count, visitor);
+    }
+}
+
+template <typename F>
+void BroadPhase::nearest(
+    const vec2 &point, int k, float maxDistance, F &&processor) {
+    using broadphase::candidate;
+
+    //! the k nearest of both trees are merged, the dynamic result
+    //! bounds the search in the static tree
+    abt::queue<candidate> merged;
+    int                   count = 0;
+    float                 bound = maxDistance;
+
+    tree.nearest(
+        point,
+        k,
+        maxDistance,
+        [&merged, &count, &bound](const abt::node *node, float distance) {
+            merged.push({node, distance});
+            bound = distance;
+            ++count;
+            return true;
+        });
+
+    staticTree.nearest(
+        point,
+        k,
+        count == k ? bound : maxDistance,
+        [&merged](const abt::node *node, float distance) {
+            merged.push({node, distance});
+            return true;
+        });
+
+    for (int i = 0; i < k && !merged.empty(); ++i) {
+        candidate e = merged.pop();
+        if (!processor(e.node, e.value)) return;
+    }
+}
+
+template <typename F>
+void BroadPhase::sweep(
+    const bbox2 &box, const vec2 &displacement, F &&processor) {
+    using broadphase::candidate;
+
+    //! the hits of the static tree are collected first and then
+    //! interleaved with the dynamic ones in order of the time of entry
+    abt::queue<candidate> pending;
+    staticTree.sweep(
+        box, displacement, [&pending](const abt::node *node, float fraction) {
+            pending.push({node, fraction});
+            return true;
+        });
+
+    bool go    = true;
+    auto flush = [&](float fraction) {
+        while (go && !pending.empty() && pending.top().value <= fraction) {
+            candidate e = pending.pop();
+            go          = processor(e.node, e.value);
+        }
+        return go;
+    };
+
+    tree.sweep(
+        box, displacement, [&](const abt::node *node, float fraction) {
+            if (!flush(fraction)) return false;
+            return go = processor(node, fraction);
+        });
+
+    flush(FLT_MAX);
+}
+
+}; // namespace lspe
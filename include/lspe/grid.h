@@ -0,0 +1,232 @@
+#pragma once
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: Spatial Hash Grid
+ *
+ *  @brief: broadphase that hashes the boxes into grid cells
+ *
+ *  @NOTES: the grid is rebuilt every step, the cells covered by each box
+ *          are counting-sorted by their hash into a flat array, so each
+ *          cell is a contiguous run and pair finding is O(n) for objects
+ *          of similar sizes (bullets, particles, crowds)
+ *          with more than one level, level l has cells of 2^l times the
+ *          base size and each object lives on the first level whose
+ *          cells are as large as the object, so it covers at most 2x2
+ *          cells, pairs across levels are found by looking up the cells
+ *          of the coarser level
+ *          an object larger than the cells of the last level covers
+ *          many cells, keep such objects in another broadphase
+ *******************************/
+
+#include "../lspe/base/base.h"
+#include "../lspe/base/vec.h"
+#include "../lspe/bbox.h"
+#include "../lspe/broadphase.h"
+
+namespace lspe {
+
+namespace grid {
+
+//! fnvisit of the spatial hash, called with the proxy id
+typedef broadphase::fnvisit fnvisit;
+
+static const int maxLevels = 16;
+
+struct entry {
+    bbox2    box;  //! box of the proxy, copied for streaming access
+    int      id;   //! proxy id
+    uint32_t cell; //! hash of the cell, the bucket takes its low bits
+                   //! cells of one bucket (almost) never share it
+};
+
+struct proxy {
+    bbox2 box;
+    void *userdata;
+    int   level; //! level of the last rebuild, next free proxy when free
+    bool  used;
+};
+
+}; // namespace grid
+
+class SpatialHash : public broadphase::Backend {
+public:
+    SpatialHash();
+    ~SpatialHash();
+
+    SpatialHash(const SpatialHash &)            = delete;
+    SpatialHash &operator=(const SpatialHash &) = delete;
+
+    void setCellSize(float size, int levels = 1);
+    //! size of the cells of level 0, defaultly 1 (meters), best about
+    //! the size of the common objects
+    //! levels > 1 makes a hierarchical grid for mixed sizes
+
+    int addObject(const bbox2 &box, void *userdata) override;
+    //! add a new object with a bounding box, return its proxy id
+
+    void delObject(int id) override;
+    //! delete the object by id (given by addObject())
+
+    void moveObject(
+        int id, const bbox2 &box, const vec2 &displacement) override;
+    //! set the box of the object, the displacement is not needed since
+    //! the boxes are tight and hashed again each step
+    void moveObjects(
+        const int   *ids,
+        const bbox2 *boxes,
+        const vec2  *displacements,
+        int          n) override;
+
+    bbox2 getBBox(int id) const;
+    void *getUserdata(int id) const override;
+    int   objectCount() const;
+
+    const broadphase::IntPair *getPairs(int *count) const override;
+    void                       updatePairs() override;
+    //! rebuild the grid and report the pairs with their events
+    //! (see broadphase::PairCache) like BroadPhase::updatePairs()
+
+    void  setPairUserdata(int first, int second, void *userdata) override;
+    void *getPairUserdata(int first, int second) const override;
+
+    void query(
+        grid::fnvisit processor, const bbox2 &box, void *extra) override;
+
+    template <typename F>
+    void query(const bbox2 &box, F &&processor);
+    //! call processor(int id, void *userdata) for each object
+    //! overlapping box, return false from processor to stop the query
+    //! the grid is searched after updatePairs(), objects changed since
+    //! then fall back to a linear scan
+
+    void raycast(
+        broadphase::fnraycast processor,
+        const vec2           &origin,
+        const vec2           &dir,
+        float                 maxFraction,
+        void                 *extra) override;
+
+    template <typename F>
+    void raycast(
+        const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor);
+    //! call float processor(int id, void *userdata, float maxFraction) for
+    //! each object whose box is hit by origin + t * dir, t in [0,
+    //! maxFraction] (see abt::fnraycast for the return value)
+    //! the candidates come from a query() of the bounds of the ray and are
+    //! met in no particular order, so clipping culls less than in a tree
+
+private:
+    int  allocateProxy(); //! return id of a new proxy
+    void freeProxy(int id);
+
+    int      levelOf(const bbox2 &box) const; //! level of an object
+    int      coordOf(float value, int level) const; //! cell coordinate
+    uint32_t cellOf(int x, int y, int level) const; //! hash of a cell
+    int      bucketOf(uint32_t cell) const; //! bucket in the flat array
+
+    bool owns(uint32_t cell, int level, const bbox2 &a, const bbox2 &b) const;
+    //! whether the cell holds the lower corner of the overlap of a and b
+    //! so a pair sharing several cells is reported once
+
+    void rebuild(); //! hash and counting sort all proxies
+
+    grid::proxy *m_proxies;
+    int          m_proxyCapacity;
+    int          m_freeproxy; //! root of the free list of proxies
+    int          m_nproxy;
+
+    grid::entry *m_entries; //! cells of all proxies sorted by bucket
+    grid::entry *m_scratch; //! cells in proxy order before the sort
+    int         *m_keys;    //! bucket of each cell in m_scratch
+    int          m_entryCapacity;
+    int          m_nentry;
+
+    int *m_starts; //! first entry of each bucket, m_nbucket + 1 of them
+    int  m_nbucket; //! power of 2
+    int  m_startCapacity;
+
+    float m_cellSize;
+    float m_invCellSizes[grid::maxLevels];
+    int   m_levels;
+    int   m_levelCounts[grid::maxLevels]; //! proxies of each level
+
+    bool m_dirty; //! modified since the last updatePairs()
+
+    broadphase::PairCache m_pairs;
+};
+
+}; // namespace lspe
+
+namespace lspe {
+
+template <typename F>
+void SpatialHash::query(const bbox2 &box, F &&processor) {
+    //! a huge box covers more cells than there are entries
+    float cells = ((box.upper.x - box.lower.x) * m_invCellSizes[0] + 1.0f)
+                * ((box.upper.y - box.lower.y) * m_invCellSizes[0] + 1.0f);
+
+    if (m_dirty || cells > m_nentry) {
+        for (int id = 0; id < m_proxyCapacity; ++id) {
+            const grid::proxy &proxy = m_proxies[id];
+            if (!proxy.used || !overlap(proxy.box, box)) continue;
+            if (!processor(id, proxy.userdata)) return;
+        }
+        return;
+    }
+
+    for (int level = 0; level < m_levels; ++level) {
+        if (m_levelCounts[level] == 0) continue;
+
+        int x0 = coordOf(box.lower.x, level);
+        int y0 = coordOf(box.lower.y, level);
+        int x1 = coordOf(box.upper.x, level);
+        int y1 = coordOf(box.upper.y, level);
+
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                uint32_t cell   = cellOf(x, y, level);
+                int      bucket = bucketOf(cell);
+                int      end    = m_starts[bucket + 1];
+                for (int i = m_starts[bucket]; i < end; ++i) {
+                    const grid::entry &e = m_entries[i];
+                    if (e.cell != cell || !overlap(e.box, box)) continue;
+
+                    const grid::proxy &proxy = m_proxies[e.id];
+                    if (proxy.level != level) continue;
+                    if (!owns(cell, level, e.box, box)) continue;
+                    if (!processor(e.id, proxy.userdata)) return;
+                }
+            }
+        }
+    }
+}
+
+template <typename F>
+void SpatialHash::raycast(
+    const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor) {
+    const vec2 invdir = abt::inverseOf(dir);
+    const vec2 end    = origin + dir * maxFraction;
+
+    bbox2 bound;
+    bound.lower.x = min(origin.x, end.x);
+    bound.lower.y = min(origin.y, end.y);
+    bound.upper.x = max(origin.x, end.x);
+    bound.upper.y = max(origin.y, end.y);
+
+    query(bound, [&](int id, void *userdata) {
+        float fraction;
+        if (!abt::raycast(
+                m_proxies[id].box, origin, invdir, maxFraction, fraction)) {
+            return true;
+        }
+
+        float value = processor(id, userdata, maxFraction);
+        if (value <= 0.0f) return false;
+        maxFraction = min(maxFraction, value);
+        return true;
+    });
+}
+
+}; // namespace lspe
@@ -6,7 +6,12 @@
 #include "../lspe/base/mat.h"
 #include "../lspe/bbox.h"
 #include "../lspe/abt.h"
+#include "../lspe/abt4.h"
+#include "../lspe/abt16.h"
+#include "../lspe/abtb.h"
 #include "../lspe/broadphase.h"
+#include "../lspe/sap.h"
+#include "../lspe/grid.h"
 #include "../lspe/shape.h"
 #include "../lspe/body.h"
 #include "../lspe/fixture.h"
@@ -0,0 +1,227 @@
+#pragma once
+
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: Sweep and Prune
+ *
+ *  @brief: broadphase that sorts the boxes along one axis and sweeps
+ *
+ *  @NOTES: the boxes are kept in an array sorted by their lower bound
+ *          along the sweep axis, which is the axis of greatest variance
+ *          of the centers, and updated by insertion sort each step
+ *          since the order barely changes from one step to the next,
+ *          the sort is nearly linear and the sweep streams the array
+ *          suits wide and flat scenes (side-scrollers) where most boxes
+ *          are separated along one axis
+ *******************************/
+
+#include "../lspe/base/base.h"
+#include "../lspe/base/vec.h"
+#include "../lspe/bbox.h"
+#include "../lspe/broadphase.h"
+
+namespace lspe {
+
+namespace sap {
+
+//! fnvisit of the sweep and prune, called with the proxy id
+typedef broadphase::fnvisit fnvisit;
+
+struct entry {
+    float lower; //! bounds along the sweep axis, the sort key
+    float upper;
+    float lowerOther; //! bounds along the other axis
+    float upperOther;
+    int   id; //! proxy id, abt::null for a deleted entry
+};
+
+struct proxy {
+    void *userdata;
+    int   slot; //! index of the entry, next free proxy when free
+    bool  used;
+};
+
+}; // namespace sap
+
+class SweepAndPrune : public broadphase::Backend {
+public:
+    SweepAndPrune();
+    ~SweepAndPrune();
+
+    SweepAndPrune(const SweepAndPrune &)            = delete;
+    SweepAndPrune &operator=(const SweepAndPrune &) = delete;
+
+    int addObject(const bbox2 &box, void *userdata) override;
+    //! add a new object with a bounding box, return its proxy id
+
+    void delObject(int id) override;
+    //! delete the object by id (given by addObject())
+
+    void moveObject(
+        int id, const bbox2 &box, const vec2 &displacement) override;
+    //! set the box of the object, the displacement is not needed since
+    //! the boxes are tight and swept again each step
+    void moveObjects(
+        const int   *ids,
+        const bbox2 *boxes,
+        const vec2  *displacements,
+        int          n) override;
+
+    bbox2 getBBox(int id) const;
+    void *getUserdata(int id) const override;
+    int   objectCount() const;
+    int   sweepAxis() const; //! 0 for x, 1 for y
+
+    const broadphase::IntPair *getPairs(int *count) const override;
+    void                       updatePairs() override;
+    //! sort and sweep, the pairs are reported with their events
+    //! (see broadphase::PairCache) like BroadPhase::updatePairs()
+
+    void  setPairUserdata(int first, int second, void *userdata) override;
+    void *getPairUserdata(int first, int second) const override;
+
+    void query(
+        sap::fnvisit processor, const bbox2 &box, void *extra) override;
+
+    template <typename F>
+    void query(const bbox2 &box, F &&processor);
+    //! call processor(int id, void *userdata) for each object
+    //! overlapping box, return false from processor to stop the query
+    //! the sorted array is searched after updatePairs(), objects changed
+    //! since then fall back to a linear scan
+
+    void raycast(
+        broadphase::fnraycast processor,
+        const vec2           &origin,
+        const vec2           &dir,
+        float                 maxFraction,
+        void                 *extra) override;
+
+    template <typename F>
+    void raycast(
+        const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor);
+    //! call float processor(int id, void *userdata, float maxFraction) for
+    //! each object whose box is hit by origin + t * dir, t in [0,
+    //! maxFraction] (see abt::fnraycast for the return value)
+    //! only the entries spanned by the ray along the axis are tested
+
+private:
+    int  allocateProxy(); //! return id of a new proxy
+    void freeProxy(int id);
+
+    void assign(sap::entry &e, const bbox2 &box) const;
+    //! write box into the entry along the current axis
+
+    void compact(); //! drop deleted entries and merge the added ones
+    void sort();    //! insertion sort of the entries by lower bound
+    void sweep();   //! report overlapping pairs, choose the next axis
+
+    void setAxis(int axis); //! swap the bounds of all entries and resort
+
+    sap::entry *m_entries;
+    int         m_entryCapacity;
+    int         m_nentry;
+    int         m_nsorted;  //! entries [0, m_nsorted) are (nearly) sorted
+    int         m_ndeleted; //! deleted entries awaiting compact()
+
+    sap::proxy *m_proxies;
+    int         m_proxyCapacity;
+    int         m_freeproxy; //! root of the free list of proxies
+    int         m_nproxy;
+
+    int   m_axis;      //! sweep axis
+    float m_maxExtent; //! largest extent along the axis at the last sweep
+    bool  m_dirty;     //! modified since the last updatePairs()
+
+    broadphase::PairCache m_pairs;
+};
+
+}; // namespace lspe
+
+namespace lspe {
+
+template <typename F>
+void SweepAndPrune::query(const bbox2 &box, F &&processor) {
+    const float lower      = box.lower[m_axis];
+    const float upper      = box.upper[m_axis];
+    const float lowerOther = box.lower[1 - m_axis];
+    const float upperOther = box.upper[1 - m_axis];
+
+    int first = 0;
+    int last  = m_nentry;
+    if (!m_dirty) {
+        //! no entry starting before lower - m_maxExtent can reach lower
+        float bound = lower - m_maxExtent;
+        int   count = m_nentry;
+        while (count > 0) {
+            int half = count / 2;
+            if (m_entries[first + half].lower < bound) {
+                first += half + 1;
+                count -= half + 1;
+            } else {
+                count = half;
+            }
+        }
+    }
+
+    for (int i = first; i < last; ++i) {
+        const sap::entry &e = m_entries[i];
+        if (!m_dirty && e.lower > upper) break;
+        if (e.id == abt::null) continue;
+
+        if (e.lower <= upper && lower <= e.upper && e.lowerOther <= upperOther
+            && lowerOther <= e.upperOther) {
+            if (!processor(e.id, m_proxies[e.id].userdata)) return;
+        }
+    }
+}
+
+template <typename F>
+void SweepAndPrune::raycast(
+    const vec2 &origin, const vec2 &dir, float maxFraction, F &&processor) {
+    const vec2 invdir = abt::inverseOf(dir);
+
+    //! the span of the ray along the axis before any clipping
+    const float end   = origin[m_axis] + dir[m_axis] * maxFraction;
+    const float lower = min(origin[m_axis], end);
+    const float upper = max(origin[m_axis], end);
+
+    int first = 0;
+    if (!m_dirty) {
+        float bound = lower - m_maxExtent;
+        int   count = m_nentry;
+        while (count > 0) {
+            int half = count / 2;
+            if (m_entries[first + half].lower < bound) {
+                first += half + 1;
+                count -= half + 1;
+            } else {
+                count = half;
+            }
+        }
+    }
+
+    for (int i = first; i < m_nentry; ++i) {
+        const sap::entry &e = m_entries[i];
+        if (!m_dirty && e.lower > upper) break;
+        if (e.id == abt::null) continue;
+
+        bbox2 box;
+        box.lower[m_axis]     = e.lower;
+        box.upper[m_axis]     = e.upper;
+        box.lower[1 - m_axis] = e.lowerOther;
+        box.upper[1 - m_axis] = e.upperOther;
+
+        float fraction;
+        if (!abt::raycast(box, origin, invdir, maxFraction, fraction)) {
+            continue;
+        }
+
+        float value = processor(e.id, m_proxies[e.id].userdata, maxFraction);
+        if (value <= 0.0f) return;
+        maxFraction = min(maxFraction, value);
+    }
+}
+
+}; // namespace lspe
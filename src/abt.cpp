@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <lspe/abt.h>
+#include <lspe/shape.h>
 
 namespace lspe {
 
@@ -12,48 +13,6 @@ bool novisit(const node *node, void *extra) {
     return true;
 }
 
-struct _querywalker {
-    fnvisit processor;
-    void   *extra;
-
-    union {
-        bbox2 *testbox;
-        vec2  *testpoint;
-    };
-
-    bool finished;
-};
-
-bool queryWalkerWithTestBox(const node *node, void *extra) {
-    auto e = (_querywalker *)extra;
-
-    if (e->finished) return false;
-
-    if (overlap(node->box, *e->testbox)) {
-        if (node->isLeaf()) { e->finished = !e->processor(node, e->extra); }
-        return !e->finished;
-    }
-
-    return false;
-}
-
-bool queryWalkerWithTestPoint(const node *node, void *extra) {
-    auto e = (_querywalker *)extra;
-
-    if (e->finished) return false;
-
-    if (contain(node->box, *e->testpoint)) {
-        if (node->isLeaf()) { e->finished = !e->processor(node, e->extra); }
-        return !e->finished;
-    }
-
-    return false;
-}
-
-void traversePreorder(node *tree, int index, fnvisit visit, void *extra);
-void traverseInorder(node *tree, int index, fnvisit visit, void *extra);
-void traversePostorder(node *tree, int index, fnvisit visit, void *extra);
-
 void traverse(abtree *tree, fnvisit visit, void *extra, int method) {
     LSPE_ASSERT(tree != nullptr);
     LSPE_ASSERT(tree->m_nodes != nullptr);
@@ -61,108 +20,136 @@ void traverse(abtree *tree, fnvisit visit, void *extra, int method) {
 
     if (visit == nullptr) { visit = novisit; }
 
+    auto walker = [visit, extra](const node *node) {
+        return visit(node, extra);
+    };
+
     switch (method) {
         case PREORDER:
-            traversePreorder(tree->m_nodes, tree->m_root, visit, extra);
+            tree->traverse<PREORDER>(walker);
             break;
         case INORDER:
-            traverseInorder(tree->m_nodes, tree->m_root, visit, extra);
+            tree->traverse<INORDER>(walker);
             break;
         case POSTORDER:
-            traversePostorder(tree->m_nodes, tree->m_root, visit, extra);
+            tree->traverse<POSTORDER>(walker);
             break;
     }
 }
 
-void traversePreorder(node *tree, int index, fnvisit visit, void *extra) {
-    if (index == null) return;
-
-    node tmp;
-    memcpy(&tmp, tree + index, sizeof(node));
-    tmp.index = index;
+convex::convex(const shape::Polygen &polygen)
+    : m_axes(m_inline)
+    , m_naxis(0) {
+    const auto &vertices = polygen.vertices;
+    const int   n        = vertices.size();
 
-    bool shouldExit = !visit(&tmp, extra);
-    if (shouldExit) return;
+    m_box = bboxOf(polygen);
 
-    traversePreorder(tree, tree[index].left, visit, extra);
-    traversePreorder(tree, tree[index].right, visit, extra);
-}
-
-void traverseInorder(node *tree, int index, fnvisit visit, void *extra) {
-    if (index == null) return;
-
-    traversePreorder(tree, tree[index].left, visit, extra);
-
-    node tmp;
-    memcpy(&tmp, tree + index, sizeof(node));
-    tmp.index = index;
-
-    bool shouldExit = !visit(&tmp, extra);
-    if (shouldExit) return;
+    if (n > capacity) {
+        m_axes = (axis *)malloc(n * sizeof(axis));
+        LSPE_ALWAYS_ASSERT(m_axes != nullptr);
+    }
 
-    traversePreorder(tree, tree[index].right, visit, extra);
+    for (int i = 0; i < n; ++i) {
+        vec2 edge   = vertices[(i + 1) % n] - vertices[i];
+        vec2 normal = vec2(-edge.y, edge.x);
+
+        //! degenerated edges and the x and y axes add nothing to m_box
+        if (normal.x == 0.0f || normal.y == 0.0f) continue;
+
+        axis &e  = m_axes[m_naxis++];
+        e.normal = normal;
+        e.lower  = dot(vertices[0], normal);
+        e.upper  = e.lower;
+        for (int j = 1; j < n; ++j) {
+            float s = dot(vertices[j], normal);
+            e.lower = min(e.lower, s);
+            e.upper = max(e.upper, s);
+        }
+    }
 }
 
-void traversePostorder(node *tree, int index, fnvisit visit, void *extra) {
-    if (index == null) return;
+convex::convex(const obb2 &box)
+    : m_axes(m_inline)
+    , m_naxis(0) {
+    m_box = bboxOf(box);
 
-    traversePreorder(tree, tree[index].left, visit, extra);
-    traversePreorder(tree, tree[index].right, visit, extra);
+    //! an axis-aligned box is fully described by m_box
+    if (box.axis.x == 0.0f || box.axis.y == 0.0f) return;
 
-    node tmp;
-    memcpy(&tmp, tree + index, sizeof(node));
-    tmp.index = index;
+    vec2  normals[2] = {box.axis, vec2(-box.axis.y, box.axis.x)};
+    float extents[2] = {box.extent.x, box.extent.y};
 
-    bool shouldExit = !visit(&tmp, extra);
-    if (shouldExit) return;
+    for (int i = 0; i < 2; ++i) {
+        axis &e  = m_axes[m_naxis++];
+        float s  = dot(box.center, normals[i]);
+        e.normal = normals[i];
+        e.lower  = s - extents[i];
+        e.upper  = s + extents[i];
+    }
 }
 
-bool node::isLeaf() const {
-    return left == null && right == null;
+convex::~convex() {
+    if (m_axes != m_inline) { ::free(m_axes); }
 }
 
 }; // namespace abt
 
 abtree::abtree()
     : m_nodes(nullptr)
-    , m_extension(2.0f) {
-    m_root = abt::null;
-
-    m_capacity = 16;
-    m_nnode    = 0;
-    m_nodes    = (abt::node *)malloc(m_capacity * sizeof(abt::node));
-
-    LSPE_ASSERT(m_nodes != nullptr);
-    memset(m_nodes, 0, m_capacity * sizeof(abt::node));
-
-    //! build linked list of the free nodes
-    for (int i = 0; i < m_capacity - 1; ++i) {
-        m_nodes[i].next   = i + 1;
-        m_nodes[i].height = -1;
-    }
-
-    m_nodes[m_capacity - 1].next   = abt::null;
-    m_nodes[m_capacity - 1].height = -1;
-    m_freenode                     = 0;
+    , m_hot(nullptr)
+    , m_extension(2.0f)
+    , m_minMargin(0.0f)
+    , m_maxMargin(0.0f)
+    , m_margin(2.0f)
+    , m_cursor(0) {
+    reset(16);
 }
 
 abtree::~abtree() {
     ::free(m_nodes); //! free the entire node pool
     m_nodes = nullptr;
+
+    ::free(m_hot);
+    m_hot = nullptr;
 }
 
 void abtree::setExtension(float r) {
     LSPE_ASSERT(r >= FLT_EPSILON); //! assume r >= 0
     m_extension = r;
+
+    bool adaptive = m_minMargin != m_maxMargin;
+    m_margin = adaptive ? min(max(r, m_minMargin), m_maxMargin) : r;
+}
+
+void abtree::setMarginRange(float lower, float upper) {
+    LSPE_ASSERT(
+        (lower == 0.0f && upper == 0.0f)
+        || (lower >= FLT_EPSILON && lower <= upper));
+    m_minMargin = lower;
+    m_maxMargin = upper;
+
+    bool adaptive = lower != upper;
+    m_margin      = adaptive ? min(max(m_extension, lower), upper)
+                             : m_extension;
+
+    for (int i = 0; i < m_capacity; ++i) {
+        abt::node &node = m_nodes[i];
+        if (node.height == -1 || !node.isLeaf()) continue;
+        node.margin = adaptive ? min(max(node.margin, lower), upper)
+                               : m_extension;
+    }
 }
 
 int abtree::addObject(const bbox2 &box, void *userdata) {
     int node = allocate();
 
-    m_nodes[node].box.lower = box.lower - m_extension;
-    m_nodes[node].box.upper = box.upper + m_extension;
+    m_nodes[node].box.lower = box.lower - m_margin;
+    m_nodes[node].box.upper = box.upper + m_margin;
     m_nodes[node].userdata  = userdata;
     m_nodes[node].moved     = true;
+    m_nodes[node].category  = ~0;
+    m_nodes[node].margin    = m_margin;
 
     insert(node);
 
@@ -181,36 +168,26 @@ bool abtree::moveObject(int id, const bbox2 &box, const vec2 &displacement) {
     LSPE_ASSERT(id >= 0 && id < m_capacity);
     LSPE_ASSERT(m_nodes[id].isLeaf());
 
-    bbox2 fattenbox;
-    fattenbox.lower = box.lower - m_extension;
-    fattenbox.upper = box.upper + m_extension;
-
-    //! predict movement
-    vec2 dp = displacement * 4.0f;
-    if (dp.x < FLT_EPSILON) {
-        fattenbox.lower.x += dp.x;
-    } else {
-        fattenbox.upper.x += dp.x;
-    }
-    if (dp.y < FLT_EPSILON) {
-        fattenbox.lower.y += dp.y;
-    } else {
-        fattenbox.upper.y += dp.y;
-    }
+    float margin    = m_nodes[id].margin;
+    bbox2 fattenbox = fatten(box, displacement, margin);
 
     const bbox2 &originbox = m_nodes[id].box;
     if (contain(originbox, box)) {
         bbox2 bound;
-        bound.lower = fattenbox.lower - m_extension * 4.0f;
-        bound.upper = fattenbox.upper + m_extension * 4.0f;
+        bound.lower = fattenbox.lower - margin * 4.0f;
+        bound.upper = fattenbox.upper + margin * 4.0f;
 
         if (contain(bound, originbox)) {
             //! origin bounding box still contains new bounding box
             //! and isn't too large
+            adapt(id, displacement, false);
             return false;
         }
 
         //! origin bounding box is too large and needs to be shrunk
+    } else {
+        adapt(id, displacement, true);
+        fattenbox = fatten(box, displacement, m_nodes[id].margin);
     }
 
     remove(id);
@@ -221,13 +198,94 @@ bool abtree::moveObject(int id, const bbox2 &box, const vec2 &displacement) {
     return true;
 }
 
+bbox2 abtree::fatten(
+    const bbox2 &box, const vec2 &displacement, float margin) const {
+    bbox2 fattenbox;
+    fattenbox.lower = box.lower - margin;
+    fattenbox.upper = box.upper + margin;
+
+    //! predict movement
+    vec2 dp = displacement * 4.0f;
+    if (dp.x < FLT_EPSILON) {
+        fattenbox.lower.x += dp.x;
+    } else {
+        fattenbox.upper.x += dp.x;
+    }
+    if (dp.y < FLT_EPSILON) {
+        fattenbox.lower.y += dp.y;
+    } else {
+        fattenbox.upper.y += dp.y;
+    }
+
+    return fattenbox;
+}
+
+void abtree::adapt(int node, const vec2 &displacement, bool escaped) {
+    if (m_minMargin == m_maxMargin) return;
+
+    //! the margin never falls below the distance the object covers in
+    //! the 4 steps predicted by fatten(), it doubles on each escape so
+    //! that a fast object stops being reinserted every step, and it
+    //! decays by 10% per step toward that floor while the object stays
+    //! inside, so a resting object is soon reinserted with a tight box
+    //! (see the shrink rule of moveObject())
+    float lower = max(displacement.norm() * 4.0f, m_minMargin);
+    lower       = min(lower, m_maxMargin);
+
+    float &margin = m_nodes[node].margin;
+    if (escaped) {
+        margin = min(max(margin * 2.0f, lower), m_maxMargin);
+    } else {
+        margin = max(margin * 0.9f, lower);
+    }
+}
+
+void abtree::setObjectBBox(int id, const bbox2 &box) {
+    LSPE_ASSERT(id >= 0 && id < m_capacity);
+    LSPE_ASSERT(m_nodes[id].isLeaf());
+
+    m_nodes[id].box.lower = box.lower - m_nodes[id].margin;
+    m_nodes[id].box.upper = box.upper + m_nodes[id].margin;
+    m_nodes[id].moved     = true;
+
+    sync(id);
+}
+
 bbox2 abtree::getFattenBBox(int id) const {
     LSPE_ASSERT(id >= 0 && id < m_capacity);
     LSPE_ASSERT(m_nodes[id].isLeaf());
 
-    bbox2 box = m_nodes[id].box;
+    return m_nodes[id].box;
+}
+
+void abtree::setCategory(int id, int32_t category) {
+    LSPE_ASSERT(id >= 0 && id < m_capacity);
+    LSPE_ASSERT(m_nodes[id].isLeaf());
+
+    m_nodes[id].category = category;
+    sync(id);
+
+    int cursor = m_nodes[id].parent;
+    while (cursor != abt::null) {
+        int     left   = m_nodes[cursor].left;
+        int     right  = m_nodes[cursor].right;
+        int32_t merged = m_nodes[left].category | m_nodes[right].category;
+
+        //! ancestors above an unchanged node are unchanged as well
+        if (m_nodes[cursor].category == merged) break;
+
+        m_nodes[cursor].category = merged;
+        sync(cursor);
 
-    return {box.lower - m_extension, box.upper + m_extension};
+        cursor = m_nodes[cursor].parent;
+    }
+}
+
+int32_t abtree::getCategory(int id) const {
+    LSPE_ASSERT(id >= 0 && id < m_capacity);
+    LSPE_ASSERT(m_nodes[id].isLeaf());
+
+    return m_nodes[id].category;
 }
 
 void *abtree::getUserdata(int id) const {
@@ -254,29 +312,133 @@ void abtree::setUnMoved(int id) {
 void abtree::query(abt::fnvisit processor, const bbox2 &box, void *extra) {
     LSPE_ASSERT(processor != nullptr);
 
-    bbox2 testbox = box;
+    query(box, [processor, extra](const abt::node *node) {
+        return processor(node, extra);
+    });
+}
 
-    abt::_querywalker qw;
-    qw.processor = processor;
-    qw.extra     = extra;
-    qw.testbox   = &testbox;
-    qw.finished  = false;
+void abtree::query(abt::fnvisit processor, const vec2 &point, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
 
-    abt::traversePreorder(m_nodes, m_root, abt::queryWalkerWithTestBox, &qw);
+    query(point, [processor, extra](const abt::node *node) {
+        return processor(node, extra);
+    });
 }
 
-void abtree::query(abt::fnvisit processor, const vec2 &point, void *extra) {
+void abtree::query(
+    abt::fnvisit processor, const bbox2 &box, int32_t mask, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(box, mask, [processor, extra](const abt::node *node) {
+        return processor(node, extra);
+    });
+}
+
+void abtree::query(
+    abt::fnvisit processor, const vec2 &point, int32_t mask, void *extra) {
     LSPE_ASSERT(processor != nullptr);
 
-    vec2 testpoint = point;
+    query(point, mask, [processor, extra](const abt::node *node) {
+        return processor(node, extra);
+    });
+}
+
+void abtree::query(
+    abt::fnvisit processor, const shape::Polygen &polygen, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
 
-    abt::_querywalker qw;
-    qw.processor = processor;
-    qw.extra     = extra;
-    qw.testpoint = &testpoint;
-    qw.finished  = false;
+    query(polygen, [processor, extra](const abt::node *node) {
+        return processor(node, extra);
+    });
+}
+
+void abtree::query(abt::fnvisit processor, const obb2 &box, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
 
-    abt::traversePreorder(m_nodes, m_root, abt::queryWalkerWithTestPoint, &qw);
+    query(box, [processor, extra](const abt::node *node) {
+        return processor(node, extra);
+    });
+}
+
+void abtree::queryPairs(abt::fnpair processor, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    queryPairs([processor, extra](const abt::node *a, const abt::node *b) {
+        return processor(a, b, extra);
+    });
+}
+
+void abtree::raycast(
+    abt::fnraycast processor,
+    const vec2    &origin,
+    const vec2    &dir,
+    float          maxFraction,
+    void          *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto caster = [processor, extra](const abt::node *node, float t) {
+        return processor(node, t, extra);
+    };
+
+    raycast(origin, dir, maxFraction, caster);
+}
+
+void abtree::raycast(
+    abt::fnraybatch processor,
+    const vec2     *origins,
+    const vec2     *dirs,
+    const float    *maxFractions,
+    int             n,
+    void           *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto caster = [processor, extra](const abt::node *node, int ray, float t) {
+        return processor(node, ray, t, extra);
+    };
+
+    raycast(origins, dirs, maxFractions, n, caster);
+}
+
+void abtree::nearest(
+    abt::fnnearest processor, const vec2 &point, int k, void *extra) {
+    nearest(processor, point, k, FLT_MAX, extra);
+}
+
+void abtree::nearest(
+    abt::fnnearest processor,
+    const vec2    &point,
+    int            k,
+    float          maxDistance,
+    void          *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](const abt::node *node, float d) {
+        return processor(node, d, extra);
+    };
+
+    nearest(point, k, maxDistance, visitor);
+}
+
+void abtree::sweep(
+    abt::fnsweep processor,
+    const bbox2 &box,
+    const vec2  &displacement,
+    void        *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](const abt::node *node, float t) {
+        return processor(node, t, extra);
+    };
+
+    sweep(box, displacement, visitor);
+}
+
+int abtree::objectCount() const {
+    return (m_nnode + 1) / 2;
+}
+
+bool abtree::owns(const abt::node *node) const {
+    return node >= m_nodes && node < m_nodes + m_capacity;
 }
 
 int abtree::allocate() {
@@ -290,6 +452,10 @@ int abtree::allocate() {
         memcpy(m_nodes, old_nodes, m_nnode * sizeof(abt::node));
         ::free(old_nodes);
 
+        m_hot = (abt::hotnode *)realloc(
+            m_hot, m_capacity * sizeof(abt::hotnode));
+        LSPE_ASSERT(m_hot != nullptr);
+
         for (int i = m_nnode; i < m_capacity - 1; ++i) {
             m_nodes[i].next   = i + 1;
             m_nodes[i].height = -1;
@@ -309,6 +475,9 @@ int abtree::allocate() {
     m_nodes[node].height   = 0;
     m_nodes[node].userdata = nullptr;
     m_nodes[node].moved    = false;
+    m_nodes[node].index    = node;
+
+    sync(node);
 
     ++m_nnode;
 
@@ -326,17 +495,11 @@ void abtree::free(int node) {
     --m_nnode;
 }
 
-void abtree::insert(int node) {
-    if (m_root == abt::null) {
-        m_root                 = node;
-        m_nodes[m_root].parent = abt::null;
-        return;
-    }
+int abtree::siblingOf(const bbox2 &originbox) const {
+    LSPE_ASSERT(m_root != abt::null);
 
-    //! find the best sibling for this node
-    //! according to the minimum compute cost
-    const bbox2 &originbox = m_nodes[node].box;
-    int          cursor    = m_root;
+    //! find the best sibling according to the minimum compute cost
+    int cursor = m_root;
     while (!m_nodes[cursor].isLeaf()) {
         int left  = m_nodes[cursor].left;
         int right = m_nodes[cursor].right;
@@ -371,6 +534,22 @@ void abtree::insert(int node) {
         cursor = leftCost < rightCost ? left : right;
     }
 
+    return cursor;
+}
+
+void abtree::insert(int node) {
+    sync(node);
+
+    if (m_root == abt::null) {
+        m_root                 = node;
+        m_nodes[m_root].parent = abt::null;
+        return;
+    }
+
+    //! copy the box since allocate() below may relocate the node pool
+    const bbox2 originbox = m_nodes[node].box;
+    int         cursor    = siblingOf(originbox);
+
     //! create a new parent
     int sibling                  = cursor;
     int old_parent               = m_nodes[sibling].parent;
@@ -379,6 +558,8 @@ void abtree::insert(int node) {
     m_nodes[new_parent].userdata = nullptr;
     m_nodes[new_parent].box      = unionOf(originbox, m_nodes[sibling].box);
     m_nodes[new_parent].height   = m_nodes[sibling].height + 1;
+    m_nodes[new_parent].category =
+        m_nodes[node].category | m_nodes[sibling].category;
 
     if (old_parent == abt::null) { //! the sibling is the root
         m_root = new_parent;
@@ -409,6 +590,9 @@ void abtree::insert(int node) {
         m_nodes[cursor].height =
             max(m_nodes[left].height, m_nodes[right].height) + 1;
         m_nodes[cursor].box = unionOf(m_nodes[left].box, m_nodes[right].box);
+        m_nodes[cursor].category =
+            m_nodes[left].category | m_nodes[right].category;
+        sync(cursor);
 
         cursor = m_nodes[cursor].parent;
     }
@@ -449,6 +633,9 @@ void abtree::remove(int node) {
                 max(m_nodes[left].height, m_nodes[right].height) + 1;
             m_nodes[cursor].box =
                 unionOf(m_nodes[left].box, m_nodes[right].box);
+            m_nodes[cursor].category =
+                m_nodes[left].category | m_nodes[right].category;
+            sync(cursor);
 
             cursor = m_nodes[cursor].parent;
         }
@@ -555,6 +742,9 @@ int abtree::balance(int node) {
             A->box = unionOf(C->box, E->box);
             B->box = unionOf(A->box, D->box);
 
+            A->category = C->category | E->category;
+            B->category = A->category | D->category;
+
             A->height = max(C->height, E->height) + 1;
             B->height = max(A->height, D->height) + 1;
         } else {
@@ -565,10 +755,16 @@ int abtree::balance(int node) {
             A->box = unionOf(C->box, D->box);
             B->box = unionOf(A->box, E->box);
 
+            A->category = C->category | D->category;
+            B->category = A->category | E->category;
+
             A->height = max(C->height, D->height) + 1;
             B->height = max(A->height, E->height) + 1;
         }
 
+        sync(nodeA);
+        sync(nodeB);
+
         return nodeB;
     }
 
@@ -602,6 +798,9 @@ int abtree::balance(int node) {
             A->box = unionOf(B->box, G->box);
             C->box = unionOf(A->box, F->box);
 
+            A->category = B->category | G->category;
+            C->category = A->category | F->category;
+
             A->height = max(B->height, G->height) + 1;
             C->height = max(A->height, F->height) + 1;
         } else {
@@ -612,16 +811,57 @@ int abtree::balance(int node) {
             A->box = unionOf(B->box, F->box);
             C->box = unionOf(A->box, G->box);
 
+            A->category = B->category | F->category;
+            C->category = A->category | G->category;
+
             A->height = max(B->height, F->height) + 1;
             C->height = max(A->height, G->height) + 1;
         }
 
+        sync(nodeA);
+        sync(nodeC);
+
         return nodeC;
     }
 
     return nodeA;
 }
 
+void abtree::reset(int capacity) {
+    ::free(m_nodes);
+    ::free(m_hot);
+
+    m_root     = abt::null;
+    m_capacity = capacity;
+    m_nnode    = 0;
+    m_nodes    = (abt::node *)malloc(m_capacity * sizeof(abt::node));
+
+    LSPE_ASSERT(m_nodes != nullptr);
+    memset(m_nodes, 0, m_capacity * sizeof(abt::node));
+
+    m_hot = (abt::hotnode *)malloc(m_capacity * sizeof(abt::hotnode));
+    LSPE_ASSERT(m_hot != nullptr);
+
+    //! build linked list of the free nodes
+    for (int i = 0; i < m_capacity - 1; ++i) {
+        m_nodes[i].next   = i + 1;
+        m_nodes[i].height = -1;
+    }
+
+    m_nodes[m_capacity - 1].next   = abt::null;
+    m_nodes[m_capacity - 1].height = -1;
+    m_freenode                     = 0;
+}
+
+void abtree::sync(int node) {
+    const abt::node &e = m_nodes[node];
+
+    m_hot[node].box      = e.box;
+    m_hot[node].left     = e.left;
+    m_hot[node].right    = e.right;
+    m_hot[node].category = e.category;
+}
+
 int abtree::height() const {
     return heightOf(m_root);
 }
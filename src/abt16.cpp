@@ -0,0 +1,182 @@
+#include <malloc.h>
+#include <math.h>
+
+#include <lspe/abt16.h>
+
+namespace lspe {
+
+namespace abt16 {
+
+struct buildtask {
+    int   source; //! node of the source abtree
+    int   target; //! node of the snapshot
+    bbox2 box;    //! decoded box of the target node
+};
+
+//! decode a single coordinate exactly as abt16::decode() does
+static inline float dequantize(float lower, float upper, int q) {
+    node e{};
+    e.lowerx[0] = q;
+    bbox2 box;
+    box.lower.x = lower;
+    box.upper.x = upper;
+    box.lower.y = box.upper.y = 0.0f;
+    return decode(e, 0, box).lower.x;
+}
+
+//! quantize v inside [lower, upper] so that the decoded value is never
+//! above v, the estimate is widened by one step and then corrected with
+//! the real decoder to stay conservative under rounding
+static inline uint16_t quantizeLower(float lower, float upper, float v) {
+    if (!(upper > lower) || v <= lower) return 0;
+    float t = (v - lower) / (upper - lower) * quantum;
+    int   q = (int)floorf(t) - 1;
+    q       = q < 0 ? 0 : (q > quantum ? quantum : q);
+    while (q > 0 && dequantize(lower, upper, q) > v) { --q; }
+    return q;
+}
+
+//! quantize v inside [lower, upper] so that the decoded value is never
+//! below v
+static inline uint16_t quantizeUpper(float lower, float upper, float v) {
+    if (!(upper > lower) || v >= upper) return quantum;
+    float t = (v - lower) / (upper - lower) * quantum;
+    int   q = (int)ceilf(t) + 1;
+    q       = q < 0 ? 0 : (q > quantum ? quantum : q);
+    while (q < quantum && dequantize(lower, upper, q) < v) { ++q; }
+    return q;
+}
+
+}; // namespace abt16
+
+abtree16::abtree16()
+    : m_nodes(nullptr)
+    , m_nnode(0)
+    , m_nodeCapacity(0)
+    , m_leaves(nullptr)
+    , m_nleaf(0)
+    , m_leafCapacity(0) {}
+
+abtree16::~abtree16() {
+    ::free(m_nodes);
+    m_nodes = nullptr;
+
+    ::free(m_leaves);
+    m_leaves = nullptr;
+}
+
+void abtree16::build(const abtree &tree) {
+    clear();
+
+    const abt::node *nodes = tree.m_nodes;
+    if (tree.m_root == abt::null) return;
+
+    m_box = nodes[tree.m_root].box;
+
+    if (nodes[tree.m_root].isLeaf()) {
+        int leaf                = allocateLeaf();
+        m_leaves[leaf].id       = nodes[tree.m_root].index;
+        m_leaves[leaf].userdata = nodes[tree.m_root].userdata;
+        return;
+    }
+
+    abt::stack<abt16::buildtask> stack;
+    stack.push({tree.m_root, allocateNode(), m_box});
+
+    while (!stack.empty()) {
+        abt16::buildtask task = stack.pop();
+
+        const int children[2] = {
+            nodes[task.source].left, nodes[task.source].right};
+
+        for (int k = 0; k < 2; ++k) {
+            const abt::node &child = nodes[children[k]];
+
+            //! m_nodes may be relocated by allocateNode()
+            //! so the target node is re-addressed on every write
+            quantize(task.target, k, child.box, task.box);
+
+            if (child.isLeaf()) {
+                int leaf                      = allocateLeaf();
+                m_leaves[leaf].id             = child.index;
+                m_leaves[leaf].userdata       = child.userdata;
+                m_nodes[task.target].child[k] = ~leaf;
+            } else {
+                int next                      = allocateNode();
+                m_nodes[task.target].child[k] = next;
+                stack.push({children[k],
+                            next,
+                            abt16::decode(m_nodes[task.target], k, task.box)});
+            }
+        }
+    }
+}
+
+void abtree16::clear() {
+    m_nnode = 0;
+    m_nleaf = 0;
+}
+
+int abtree16::nodeCount() const {
+    return m_nnode;
+}
+
+int abtree16::leafCount() const {
+    return m_nleaf;
+}
+
+size_t abtree16::memoryUsage() const {
+    return m_nnode * sizeof(abt16::node) + m_nleaf * sizeof(abt16::leaf);
+}
+
+void abtree16::query(abt16::fnvisit processor, const bbox2 &box, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(box, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+void abtree16::query(abt16::fnvisit processor, const vec2 &point, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(point, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+int abtree16::allocateNode() {
+    if (m_nnode == m_nodeCapacity) {
+        m_nodeCapacity = m_nodeCapacity == 0 ? 16 : m_nodeCapacity * 2;
+        m_nodes        = (abt16::node *)realloc(
+            m_nodes, m_nodeCapacity * sizeof(abt16::node));
+        LSPE_ALWAYS_ASSERT(m_nodes != nullptr);
+    }
+
+    return m_nnode++;
+}
+
+int abtree16::allocateLeaf() {
+    if (m_nleaf == m_leafCapacity) {
+        m_leafCapacity = m_leafCapacity == 0 ? 16 : m_leafCapacity * 2;
+        m_leaves       = (abt16::leaf *)realloc(
+            m_leaves, m_leafCapacity * sizeof(abt16::leaf));
+        LSPE_ALWAYS_ASSERT(m_leaves != nullptr);
+    }
+
+    return m_nleaf++;
+}
+
+void abtree16::quantize(
+    int node, int k, const bbox2 &box, const bbox2 &parent) {
+    using namespace abt16;
+
+    abt16::node &e = m_nodes[node];
+
+    e.lowerx[k] = quantizeLower(parent.lower.x, parent.upper.x, box.lower.x);
+    e.lowery[k] = quantizeLower(parent.lower.y, parent.upper.y, box.lower.y);
+    e.upperx[k] = quantizeUpper(parent.lower.x, parent.upper.x, box.upper.x);
+    e.uppery[k] = quantizeUpper(parent.lower.y, parent.upper.y, box.upper.y);
+}
+
+}; // namespace lspe
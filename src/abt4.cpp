@@ -0,0 +1,156 @@
+#include <float.h>
+#include <malloc.h>
+#include <string.h>
+
+#include <lspe/abt4.h>
+
+namespace lspe {
+
+abtree4::abtree4()
+    : m_nodes(nullptr)
+    , m_nnode(0)
+    , m_nodeCapacity(0)
+    , m_leaves(nullptr)
+    , m_nleaf(0)
+    , m_leafCapacity(0) {}
+
+abtree4::~abtree4() {
+    ::free(m_nodes);
+    m_nodes = nullptr;
+
+    ::free(m_leaves);
+    m_leaves = nullptr;
+}
+
+void abtree4::build(const abtree &tree) {
+    clear();
+
+    const abt::node *nodes = tree.m_nodes;
+    if (tree.m_root == abt::null) return;
+
+    //! pairs of (source node, snapshot node) waiting to be collapsed
+    abt::stack<> stack;
+    stack.push(tree.m_root);
+    stack.push(allocateNode());
+
+    while (!stack.empty()) {
+        int target = stack.pop();
+        int source = stack.pop();
+
+        //! gather up to 4 descendants by repeatedly opening the
+        //! internal slot with the largest perimeter
+        int slots[4];
+        int nslot = 0;
+
+        if (nodes[source].isLeaf()) { //! only happens at a single-leaf root
+            slots[nslot++] = source;
+        } else {
+            slots[nslot++] = nodes[source].left;
+            slots[nslot++] = nodes[source].right;
+        }
+
+        while (nslot < 4) {
+            int   best      = -1;
+            float perimeter = -1.0f;
+            for (int i = 0; i < nslot; ++i) {
+                if (nodes[slots[i]].isLeaf()) continue;
+                float p = perimeterOf(nodes[slots[i]].box);
+                if (p > perimeter) {
+                    perimeter = p;
+                    best      = i;
+                }
+            }
+            if (best == -1) break;
+
+            int opened     = slots[best];
+            slots[best]    = nodes[opened].left;
+            slots[nslot++] = nodes[opened].right;
+        }
+
+        m_nodes[target].count = nslot;
+        for (int i = 0; i < 4; ++i) {
+            //! m_nodes may be relocated by allocateNode()
+            //! so the target node is re-addressed on every write
+            if (i >= nslot) {
+                m_nodes[target].lowerx[i] = FLT_MAX;
+                m_nodes[target].lowery[i] = FLT_MAX;
+                m_nodes[target].upperx[i] = -FLT_MAX;
+                m_nodes[target].uppery[i] = -FLT_MAX;
+                m_nodes[target].child[i]  = 0;
+                continue;
+            }
+
+            const abt::node &child = nodes[slots[i]];
+
+            m_nodes[target].lowerx[i] = child.box.lower.x;
+            m_nodes[target].lowery[i] = child.box.lower.y;
+            m_nodes[target].upperx[i] = child.box.upper.x;
+            m_nodes[target].uppery[i] = child.box.upper.y;
+
+            if (child.isLeaf()) {
+                int leaf                 = allocateLeaf();
+                m_leaves[leaf].id        = child.index;
+                m_leaves[leaf].userdata  = child.userdata;
+                m_nodes[target].child[i] = ~leaf;
+            } else {
+                int next                 = allocateNode();
+                m_nodes[target].child[i] = next;
+                stack.push(slots[i]);
+                stack.push(next);
+            }
+        }
+    }
+}
+
+void abtree4::clear() {
+    m_nnode = 0;
+    m_nleaf = 0;
+}
+
+int abtree4::nodeCount() const {
+    return m_nnode;
+}
+
+int abtree4::leafCount() const {
+    return m_nleaf;
+}
+
+void abtree4::query(abt4::fnvisit processor, const bbox2 &box, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(box, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+void abtree4::query(abt4::fnvisit processor, const vec2 &point, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(point, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+int abtree4::allocateNode() {
+    if (m_nnode == m_nodeCapacity) {
+        m_nodeCapacity = m_nodeCapacity == 0 ? 16 : m_nodeCapacity * 2;
+        m_nodes        = (abt4::node *)realloc(
+            m_nodes, m_nodeCapacity * sizeof(abt4::node));
+        LSPE_ALWAYS_ASSERT(m_nodes != nullptr);
+    }
+
+    return m_nnode++;
+}
+
+int abtree4::allocateLeaf() {
+    if (m_nleaf == m_leafCapacity) {
+        m_leafCapacity = m_leafCapacity == 0 ? 16 : m_leafCapacity * 2;
+        m_leaves       = (abt4::leaf *)realloc(
+            m_leaves, m_leafCapacity * sizeof(abt4::leaf));
+        LSPE_ALWAYS_ASSERT(m_leaves != nullptr);
+    }
+
+    return m_nleaf++;
+}
+
+}; // namespace lspe
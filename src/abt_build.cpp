@@ -0,0 +1,605 @@
+#include <float.h>
+#include <malloc.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+#include <lspe/base/parallel.h>
+#include <lspe/base/simd.h>
+#include <lspe/abt.h>
+
+namespace lspe {
+
+namespace abt {
+
+static const int binCount = 16; //! number of bins per SAH split
+
+struct bin {
+    bbox2 box;
+    int   count;
+};
+
+struct buildtask {
+    int begin, end; //! range [begin, end) of the leaves
+    int parent;     //! parent of the subtree to build
+    bool isLeft;    //! whether the subtree is the left child of parent
+};
+
+//! spread the lower 16 bits of x to the even bits
+static inline uint32_t expandBits(uint32_t x) {
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+//! 32-bit Morton code of a point normalized into [0, 1]^2
+static inline uint32_t mortonOf(float x, float y) {
+    x = min(max(x * 65536.0f, 0.0f), 65535.0f);
+    y = min(max(y * 65536.0f, 0.0f), 65535.0f);
+    return expandBits(uint32_t(x)) | (expandBits(uint32_t(y)) << 1);
+}
+
+//! stable LSD radix sort of (keys, values) with 8-bit digits
+//! histograms and scatters are done per chunk in parallel
+static void radixSort(uint32_t *keys, int *values, int n, int threads) {
+    uint32_t *keys2   = (uint32_t *)malloc(n * sizeof(uint32_t));
+    int      *values2 = (int *)malloc(n * sizeof(int));
+    LSPE_ALWAYS_ASSERT(keys2 != nullptr && values2 != nullptr);
+
+    std::vector<int> histogram(threads * 256);
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        std::fill(histogram.begin(), histogram.end(), 0);
+
+        parallelFor(n, threads, [&](int begin, int end, int w) {
+            int *h = histogram.data() + w * 256;
+            for (int i = begin; i < end; ++i) {
+                ++h[(keys[i] >> shift) & 0xff];
+            }
+        });
+
+        //! turn counts into scatter offsets, chunk by chunk in each digit
+        //! so the sort stays stable
+        int offset = 0;
+        for (int d = 0; d < 256; ++d) {
+            for (int w = 0; w < threads; ++w) {
+                int count              = histogram[w * 256 + d];
+                histogram[w * 256 + d] = offset;
+                offset += count;
+            }
+        }
+
+        parallelFor(n, threads, [&](int begin, int end, int w) {
+            int *h = histogram.data() + w * 256;
+            for (int i = begin; i < end; ++i) {
+                int pos      = h[(keys[i] >> shift) & 0xff]++;
+                keys2[pos]   = keys[i];
+                values2[pos] = values[i];
+            }
+        });
+
+        memcpy(keys, keys2, n * sizeof(uint32_t));
+        memcpy(values, values2, n * sizeof(int));
+    }
+
+    ::free(values2);
+    ::free(keys2);
+}
+
+}; // namespace abt
+
+void abtree::build(const bbox2 *boxes, void **userdata, int n, int *ids) {
+    LSPE_ASSERT(n >= 0);
+    LSPE_ASSERT(n == 0 || boxes != nullptr);
+
+    int capacity = 16;
+    while (capacity < n * 2) { capacity *= 2; }
+    reset(capacity);
+
+    if (n == 0) return;
+
+    int *leaves = (int *)malloc(n * sizeof(int));
+    LSPE_ALWAYS_ASSERT(leaves != nullptr);
+
+    for (int i = 0; i < n; ++i) {
+        int node = allocate(); //! fresh pool hands out 0..n-1 in order
+
+        m_nodes[node].box.lower = boxes[i].lower - m_margin;
+        m_nodes[node].box.upper = boxes[i].upper + m_margin;
+        m_nodes[node].userdata  = userdata != nullptr ? userdata[i] : nullptr;
+        m_nodes[node].moved     = true;
+        m_nodes[node].category  = ~0;
+        m_nodes[node].margin    = m_margin;
+
+        leaves[i] = node;
+        if (ids != nullptr) { ids[i] = node; }
+    }
+
+    m_root                 = buildTopDown(leaves, n);
+    m_nodes[m_root].parent = abt::null;
+
+    ::free(leaves);
+}
+
+int abtree::buildTopDown(int *leaves, int n) {
+    LSPE_ASSERT(n > 0);
+
+    if (n == 1) {
+        sync(leaves[0]);
+        return leaves[0];
+    }
+
+    //! centroids and bin ids are indexed by node
+    //! so they follow the partitioning of leaves
+    vec2 *centers = (vec2 *)malloc(m_capacity * sizeof(vec2));
+    int  *binIds  = (int *)malloc(m_capacity * sizeof(int));
+    LSPE_ALWAYS_ASSERT(centers != nullptr && binIds != nullptr);
+    for (int i = 0; i < n; ++i) {
+        centers[leaves[i]] = centerOf(m_nodes[leaves[i]].box);
+    }
+
+    //! internal nodes in creation order, parents always come first
+    int *internals = (int *)malloc((n - 1) * sizeof(int));
+    LSPE_ALWAYS_ASSERT(internals != nullptr);
+    int ninternal = 0;
+
+    abt::buildtask *tasks =
+        (abt::buildtask *)malloc(n * sizeof(abt::buildtask));
+    LSPE_ALWAYS_ASSERT(tasks != nullptr);
+    int ntask = 0;
+
+    int root       = abt::null;
+    tasks[ntask++] = {0, n, abt::null, true};
+
+    while (ntask > 0) {
+        abt::buildtask task  = tasks[--ntask];
+        int            count = task.end - task.begin;
+        int            node  = leaves[task.begin];
+
+        if (count > 1) {
+            //! bounds of the boxes and of their centers
+            bbox2 box    = m_nodes[node].box;
+            bbox2 bounds = {centers[node], centers[node]};
+            for (int i = task.begin + 1; i < task.end; ++i) {
+                const bbox2 &b = m_nodes[leaves[i]].box;
+                const vec2  &c = centers[leaves[i]];
+
+                box.lower.x    = min(box.lower.x, b.lower.x);
+                box.lower.y    = min(box.lower.y, b.lower.y);
+                box.upper.x    = max(box.upper.x, b.upper.x);
+                box.upper.y    = max(box.upper.y, b.upper.y);
+                bounds.lower.x = min(bounds.lower.x, c.x);
+                bounds.lower.y = min(bounds.lower.y, c.y);
+                bounds.upper.x = max(bounds.upper.x, c.x);
+                bounds.upper.y = max(bounds.upper.y, c.y);
+            }
+
+            vec2 extent = bounds.upper - bounds.lower;
+            int  axis   = extent.x >= extent.y ? 0 : 1;
+            int  mid    = task.begin + count / 2; //! fallback: median split
+
+            if (extent[axis] > FLT_EPSILON) {
+                abt::bin bins[abt::binCount];
+                for (int i = 0; i < abt::binCount; ++i) { bins[i].count = 0; }
+
+                float scale = abt::binCount / extent[axis];
+                float base  = bounds.lower[axis];
+
+                for (int i = task.begin; i < task.end; ++i) {
+                    int leaf = leaves[i];
+                    int k    = int((centers[leaf][axis] - base) * scale);
+                    k        = min(k, abt::binCount - 1);
+
+                    const bbox2 &leafbox = m_nodes[leaf].box;
+                    abt::bin    &b       = bins[k];
+                    b.box = b.count == 0 ? leafbox : unionOf(b.box, leafbox);
+                    ++b.count;
+                    binIds[leaf] = k;
+                }
+
+                //! sweep from the right to get the cost of each right part
+                float rightCost[abt::binCount];
+                bbox2 acc;
+                int   accCount = 0;
+                for (int i = abt::binCount - 1; i > 0; --i) {
+                    if (bins[i].count > 0) {
+                        acc = accCount == 0 ? bins[i].box
+                                            : unionOf(acc, bins[i].box);
+                        accCount += bins[i].count;
+                    }
+                    rightCost[i] = accCount == 0 ? 0.0f
+                                                 : perimeterOf(acc) * accCount;
+                }
+
+                //! sweep from the left and pick the cheapest split plane
+                float bestCost = FLT_MAX;
+                int   bestBin  = -1;
+                accCount       = 0;
+                for (int i = 0; i < abt::binCount - 1; ++i) {
+                    if (bins[i].count > 0) {
+                        acc = accCount == 0 ? bins[i].box
+                                            : unionOf(acc, bins[i].box);
+                        accCount += bins[i].count;
+                    }
+                    if (accCount == 0 || accCount == count) continue;
+                    float cost = perimeterOf(acc) * accCount + rightCost[i + 1];
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestBin  = i;
+                    }
+                }
+
+                if (bestBin != -1) {
+                    int *first = std::partition(
+                        leaves + task.begin,
+                        leaves + task.end,
+                        [&](int leaf) { return binIds[leaf] <= bestBin; });
+                    mid = int(first - leaves);
+                }
+            }
+
+            node                   = allocate();
+            m_nodes[node].box      = box;
+            m_nodes[node].userdata = nullptr;
+            internals[ninternal++] = node;
+
+            //! push right first so the left subtree is built first
+            tasks[ntask++] = {mid, task.end, node, false};
+            tasks[ntask++] = {task.begin, mid, node, true};
+        }
+
+        m_nodes[node].parent = task.parent;
+        if (task.parent == abt::null) {
+            root = node;
+        } else if (task.isLeft) {
+            m_nodes[task.parent].left = node;
+        } else {
+            m_nodes[task.parent].right = node;
+        }
+    }
+
+    //! children are created after their parent
+    //! so heights can be settled in the reverse creation order
+    for (int i = ninternal - 1; i >= 0; --i) {
+        int node  = internals[i];
+        int left  = m_nodes[node].left;
+        int right = m_nodes[node].right;
+
+        m_nodes[node].height =
+            max(m_nodes[left].height, m_nodes[right].height) + 1;
+        m_nodes[node].category =
+            m_nodes[left].category | m_nodes[right].category;
+        sync(node);
+    }
+
+    for (int i = 0; i < n; ++i) { sync(leaves[i]); }
+
+    ::free(tasks);
+    ::free(internals);
+    ::free(binIds);
+    ::free(centers);
+
+    return root;
+}
+
+void abtree::rebuild(int method, int threads) {
+    LSPE_ASSERT(method == abt::SAH || method == abt::LBVH);
+
+    if (m_root == abt::null) return;
+
+    //! collect leaves and release all internal nodes
+    int *leaves = (int *)malloc(m_capacity * sizeof(int));
+    LSPE_ALWAYS_ASSERT(leaves != nullptr);
+    int n = 0;
+
+    for (int i = 0; i < m_capacity; ++i) {
+        if (m_nodes[i].height == 0) {
+            leaves[n++] = i;
+        } else if (m_nodes[i].height > 0) {
+            this->free(i);
+        }
+    }
+
+    if (method == abt::SAH) {
+        m_root = buildTopDown(leaves, n);
+    } else {
+        if (threads <= 0) {
+            threads = max(1, int(std::thread::hardware_concurrency()));
+        }
+        m_root = buildLinear(leaves, n, threads);
+    }
+    m_nodes[m_root].parent = abt::null;
+
+    ::free(leaves);
+}
+
+int abtree::moveObjects(
+    const int   *ids,
+    const bbox2 *boxes,
+    const vec2  *displacements,
+    int          n,
+    int         *moved) {
+    using namespace simd;
+
+    LSPE_ASSERT(n >= 0);
+    LSPE_ASSERT(n == 0 || (ids != nullptr && boxes != nullptr));
+
+    if (n == 0) return 0;
+
+    //! indices (into ids) of the objects that escaped their boxes
+    int *escapees = (int *)malloc(n * sizeof(int));
+    LSPE_ALWAYS_ASSERT(escapees != nullptr);
+    int nescapee = 0;
+
+    const vec2 zerodisp(0.0f, 0.0f);
+
+    //! classify 4 objects at a time, the same tests as moveObject()
+    //! a short tail repeats its last object in the unused lanes
+    const f32x4 zero    = splat(0.0f);
+    const f32x4 epsilon = splat(FLT_EPSILON);
+    const f32x4 four    = splat(4.0f);
+
+    for (int i = 0; i < n; i += 4) {
+        int   count = min(4, n - i);
+        float olx[4], oly[4], oux[4], ouy[4]; //! stored fatten boxes
+        float blx[4], bly[4], bux[4], buy[4]; //! new boxes
+        float dx[4], dy[4];                   //! predicted movements
+        float margins[4];
+
+        for (int k = 0; k < 4; ++k) {
+            int j  = i + min(k, count - 1);
+            int id = ids[j];
+            LSPE_ASSERT(id >= 0 && id < m_capacity);
+            LSPE_ASSERT(m_nodes[id].isLeaf());
+
+            const bbox2 &origin = m_hot[id].box;
+            olx[k]              = origin.lower.x;
+            oly[k]              = origin.lower.y;
+            oux[k]              = origin.upper.x;
+            ouy[k]              = origin.upper.y;
+
+            blx[k] = boxes[j].lower.x;
+            bly[k] = boxes[j].lower.y;
+            bux[k] = boxes[j].upper.x;
+            buy[k] = boxes[j].upper.y;
+
+            vec2 dp = displacements ? displacements[j] * 4.0f : vec2(0, 0);
+            dx[k]   = dp.x;
+            dy[k]   = dp.y;
+
+            margins[k] = m_nodes[id].margin;
+        }
+
+        const f32x4 ext  = load(margins);
+        const f32x4 bext = ext * four;
+
+        f32x4 vdx = load(dx), vdy = load(dy);
+        f32x4 negx = cmplt(vdx, epsilon), negy = cmplt(vdy, epsilon);
+
+        f32x4 vblx = load(blx), vbly = load(bly);
+        f32x4 vbux = load(bux), vbuy = load(buy);
+        f32x4 volx = load(olx), voly = load(oly);
+        f32x4 voux = load(oux), vouy = load(ouy);
+
+        //! the origin box still contains the new box
+        f32x4 inside = cmple(volx, vblx) & cmple(voly, vbly)
+                     & cmple(vbux, voux) & cmple(vbuy, vouy);
+
+        //! the origin box isn't too large compared with the new one
+        f32x4 lx = vblx - ext + select(negx, vdx, zero) - bext;
+        f32x4 ly = vbly - ext + select(negy, vdy, zero) - bext;
+        f32x4 ux = vbux + ext + select(negx, zero, vdx) + bext;
+        f32x4 uy = vbuy + ext + select(negy, zero, vdy) + bext;
+
+        f32x4 tight = cmple(lx, volx) & cmple(ly, voly) & cmple(voux, ux)
+                    & cmple(vouy, uy);
+
+        int stay   = movemask(inside & tight);
+        int escape = ~movemask(inside);
+        for (int k = 0; k < count; ++k) {
+            int         j = i + k;
+            const vec2 &d = displacements ? displacements[j] : zerodisp;
+            if (stay & (1 << k)) {
+                adapt(ids[j], d, false);
+            } else {
+                //! margins of the escaped objects grow before fattening
+                if (escape & (1 << k)) { adapt(ids[j], d, true); }
+                escapees[nescapee++] = j;
+            }
+        }
+    }
+
+    if (nescapee == 0) {
+        ::free(escapees);
+        return 0;
+    }
+
+    bbox2 *fattenboxes = (bbox2 *)malloc(nescapee * sizeof(bbox2));
+    LSPE_ALWAYS_ASSERT(fattenboxes != nullptr);
+
+    for (int i = 0; i < nescapee; ++i) {
+        int j          = escapees[i];
+        fattenboxes[i] = fatten(
+            boxes[j],
+            displacements ? displacements[j] : zerodisp,
+            m_nodes[ids[j]].margin);
+    }
+
+    vec2  first  = centerOf(fattenboxes[0]);
+    bbox2 bounds = {first, first};
+    for (int i = 1; i < nescapee; ++i) {
+        vec2 c = centerOf(fattenboxes[i]);
+        bounds = unionOf(bounds, {c, c});
+    }
+
+    //! reinsert along the Morton curve of the new centers, so that
+    //! consecutive insertions walk down mostly the same path
+    //! each object is removed right before its reinsertion, removing
+    //! all of them up front was measured to give a much worse tree
+    vec2 extent = bounds.upper - bounds.lower;
+    vec2 scale  = {
+        extent.x > FLT_EPSILON ? 1.0f / extent.x : 0.0f,
+        extent.y > FLT_EPSILON ? 1.0f / extent.y : 0.0f};
+
+    uint32_t *codes = (uint32_t *)malloc(nescapee * sizeof(uint32_t));
+    int      *order = (int *)malloc(nescapee * sizeof(int));
+    LSPE_ALWAYS_ASSERT(codes != nullptr && order != nullptr);
+
+    for (int i = 0; i < nescapee; ++i) {
+        vec2 c   = centerOf(fattenboxes[i]) - bounds.lower;
+        codes[i] = abt::mortonOf(c.x * scale.x, c.y * scale.y);
+        order[i] = i;
+    }
+
+    abt::radixSort(codes, order, nescapee, 1);
+
+    for (int i = 0; i < nescapee; ++i) {
+        int slot = order[i];
+        int id   = ids[escapees[slot]];
+
+        remove(id);
+        m_nodes[id].box = fattenboxes[slot];
+        insert(id);
+        m_nodes[id].moved = true;
+        if (moved != nullptr) { moved[i] = id; }
+    }
+
+    ::free(order);
+    ::free(codes);
+    ::free(fattenboxes);
+    ::free(escapees);
+
+    return nescapee;
+}
+
+int abtree::buildLinear(int *leaves, int n, int threads) {
+    LSPE_ASSERT(n > 0);
+    LSPE_ASSERT(threads > 0);
+
+    if (n == 1) {
+        sync(leaves[0]);
+        return leaves[0];
+    }
+
+    //! sort leaves along the Morton curve of their centers
+    vec2  first  = centerOf(m_nodes[leaves[0]].box);
+    bbox2 bounds = {first, first};
+    for (int i = 1; i < n; ++i) {
+        vec2 c = centerOf(m_nodes[leaves[i]].box);
+        bounds = unionOf(bounds, {c, c});
+    }
+
+    vec2 extent = bounds.upper - bounds.lower;
+    vec2 scale  = {
+        extent.x > FLT_EPSILON ? 1.0f / extent.x : 0.0f,
+        extent.y > FLT_EPSILON ? 1.0f / extent.y : 0.0f};
+
+    uint32_t *codes = (uint32_t *)malloc(n * sizeof(uint32_t));
+    LSPE_ALWAYS_ASSERT(codes != nullptr);
+
+    parallelFor(n, threads, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i) {
+            vec2 c   = centerOf(m_nodes[leaves[i]].box) - bounds.lower;
+            codes[i] = abt::mortonOf(c.x * scale.x, c.y * scale.y);
+        }
+    });
+
+    abt::radixSort(codes, leaves, n, threads);
+
+    //! internal nodes are taken from the pool before going parallel
+    int *internals = (int *)malloc((n - 1) * sizeof(int));
+    LSPE_ALWAYS_ASSERT(internals != nullptr);
+    for (int i = 0; i < n - 1; ++i) {
+        internals[i]                 = allocate();
+        m_nodes[internals[i]].height = -1; //! not settled yet
+    }
+
+    //! length of the common prefix of keys i and j
+    //! duplicated codes are told apart by their positions
+    auto delta = [codes, n](int i, int j) {
+        if (j < 0 || j >= n) return -1;
+        if (codes[i] == codes[j]) { return 32 + __builtin_clz(i ^ j); }
+        return __builtin_clz(codes[i] ^ codes[j]);
+    };
+
+    //! emit the hierarchy, each internal node is independent
+    //! see Karras 2012, "Maximizing Parallelism in the Construction of
+    //! BVHs, Octrees, and k-d Trees"
+    parallelFor(n - 1, threads, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i) {
+            int d    = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int dmin = delta(i, i - d);
+
+            //! find the other end of the range
+            int lmax = 2;
+            while (delta(i, i + lmax * d) > dmin) { lmax *= 2; }
+            int l = 0;
+            for (int t = lmax / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (l + t) * d) > dmin) { l += t; }
+            }
+            int j = i + l * d;
+
+            //! find the split position
+            int dnode = delta(i, j);
+            int s     = 0;
+            for (int div = 2;; div *= 2) {
+                int t = (l + div - 1) / div;
+                if (delta(i, i + (s + t) * d) > dnode) { s += t; }
+                if (t == 1) break;
+            }
+            int split = i + s * d + min(d, 0);
+
+            int node  = internals[i];
+            int left  = min(i, j) == split ? leaves[split] : internals[split];
+            int right = max(i, j) == split + 1 ? leaves[split + 1]
+                                               : internals[split + 1];
+
+            m_nodes[node].left    = left;
+            m_nodes[node].right   = right;
+            m_nodes[left].parent  = node;
+            m_nodes[right].parent = node;
+        }
+    });
+
+    //! settle boxes and heights bottom-up
+    //! the second child reaching a parent is the one to update it
+    std::vector<std::atomic<int>> arrivals(m_capacity);
+    parallelFor(n, threads, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i) {
+            int node = m_nodes[leaves[i]].parent;
+            while (node != abt::null) {
+                if (arrivals[node].fetch_add(1, std::memory_order_acq_rel)
+                    == 0) {
+                    break;
+                }
+
+                int left  = m_nodes[node].left;
+                int right = m_nodes[node].right;
+
+                m_nodes[node].box =
+                    unionOf(m_nodes[left].box, m_nodes[right].box);
+                m_nodes[node].height =
+                    max(m_nodes[left].height, m_nodes[right].height) + 1;
+                m_nodes[node].category =
+                    m_nodes[left].category | m_nodes[right].category;
+
+                node = m_nodes[node].parent;
+            }
+        }
+    });
+
+    for (int i = 0; i < n - 1; ++i) { sync(internals[i]); }
+    for (int i = 0; i < n; ++i) { sync(leaves[i]); }
+
+    int root = internals[0];
+
+    ::free(internals);
+    ::free(codes);
+
+    return root;
+}
+
+}; // namespace lspe
@@ -0,0 +1,212 @@
+#include <float.h>
+
+#include <lspe/abt.h>
+
+namespace lspe {
+
+void abtree::optimize(int budget) {
+    LSPE_ASSERT(budget >= 0);
+
+    //! scan the pool round-robin so every internal node gets its turn
+    for (int scanned = 0; budget > 0 && scanned < m_capacity; ++scanned) {
+        if (m_cursor >= m_capacity) { m_cursor = 0; }
+
+        int node = m_cursor++;
+        if (m_nodes[node].height <= 0) continue; //! free or leaf node
+
+        rotate(node);
+        --budget;
+    }
+}
+
+void abtree::refit(int budget) {
+    LSPE_ASSERT(budget >= 0);
+
+    //! post-order walk, an internal node is pushed once more as ~node
+    //! under its children and refitted when popped the second time
+    if (m_root != abt::null && !m_nodes[m_root].isLeaf()) {
+        abt::stack<> stack;
+        stack.push(m_root);
+
+        while (!stack.empty()) {
+            int node = stack.pop();
+
+            if (node < 0) {
+                node = ~node;
+
+                const abt::node &left  = m_nodes[m_nodes[node].left];
+                const abt::node &right = m_nodes[m_nodes[node].right];
+
+                m_nodes[node].box      = unionOf(left.box, right.box);
+                m_nodes[node].category = left.category | right.category;
+                sync(node);
+                continue;
+            }
+
+            stack.push(~node);
+            int left  = m_nodes[node].left;
+            int right = m_nodes[node].right;
+            if (!m_nodes[left].isLeaf()) { stack.push(left); }
+            if (!m_nodes[right].isLeaf()) { stack.push(right); }
+        }
+    }
+
+    if (budget > 0) { optimize(budget); }
+}
+
+float abtree::cost() const {
+    float total = 0.0f;
+    for (int i = 0; i < m_capacity; ++i) {
+        if (m_nodes[i].height > 0) { total += perimeterOf(m_nodes[i].box); }
+    }
+    return total;
+}
+
+bool abtree::rotate(int node) {
+    /** candidates (A is the given node):
+     *                 A
+     *              /     \
+     *             B       C
+     *            / \     / \
+     *           D  E    F  G
+     *  swap B<->F, B<->G when C is internal (changes C)
+     *  swap C<->D, C<->E when B is internal (changes B)
+     *  swap D<->F, D<->G when both are internal (changes B and C)
+     *  the box of A never changes, so each candidate is rated by the
+     *  change of the perimeter of B and/or C
+     **/
+
+    LSPE_ASSERT(node != abt::null);
+
+    abt::node *A = m_nodes + node;
+    if (A->isLeaf()) return false;
+
+    int nodeB = A->left;
+    int nodeC = A->right;
+
+    const abt::node *B = m_nodes + nodeB;
+    const abt::node *C = m_nodes + nodeC;
+
+    if (B->isLeaf() && C->isLeaf()) return false;
+
+    enum { eNone, eBF, eBG, eCD, eCE, eDF, eDG };
+
+    int   best      = eNone;
+    float bestDelta = -FLT_EPSILON; //! only accept a strict improvement
+
+    auto consider = [&](int rotation, float delta) {
+        if (delta < bestDelta) {
+            bestDelta = delta;
+            best      = rotation;
+        }
+    };
+
+    if (!C->isLeaf()) {
+        const bbox2 &F     = m_nodes[C->left].box;
+        const bbox2 &G     = m_nodes[C->right].box;
+        float        costC = perimeterOf(C->box);
+
+        consider(eBF, perimeterOf(unionOf(B->box, G)) - costC);
+        consider(eBG, perimeterOf(unionOf(B->box, F)) - costC);
+    }
+
+    if (!B->isLeaf()) {
+        const bbox2 &D     = m_nodes[B->left].box;
+        const bbox2 &E     = m_nodes[B->right].box;
+        float        costB = perimeterOf(B->box);
+
+        consider(eCD, perimeterOf(unionOf(C->box, E)) - costB);
+        consider(eCE, perimeterOf(unionOf(C->box, D)) - costB);
+
+        if (!C->isLeaf()) {
+            const bbox2 &F      = m_nodes[C->left].box;
+            const bbox2 &G      = m_nodes[C->right].box;
+            float        costBC = costB + perimeterOf(C->box);
+
+            consider(
+                eDF,
+                perimeterOf(unionOf(F, E)) + perimeterOf(unionOf(D, G))
+                    - costBC);
+            consider(
+                eDG,
+                perimeterOf(unionOf(G, E)) + perimeterOf(unionOf(F, D))
+                    - costBC);
+        }
+    }
+
+    switch (best) {
+        case eNone:
+            return false;
+        case eBF:
+            swap(nodeB, C->left);
+            break;
+        case eBG:
+            swap(nodeB, C->right);
+            break;
+        case eCD:
+            swap(nodeC, B->left);
+            break;
+        case eCE:
+            swap(nodeC, B->right);
+            break;
+        case eDF:
+            swap(B->left, C->left);
+            break;
+        case eDG:
+            swap(B->left, C->right);
+            break;
+    }
+
+    //! refresh the changed children of A (bottom first), then A itself
+    //! and finally the heights of the ancestors
+    for (int child : {A->left, A->right}) {
+        abt::node *X = m_nodes + child;
+        if (!X->isLeaf()) {
+            X->box = unionOf(m_nodes[X->left].box, m_nodes[X->right].box);
+            X->height =
+                max(m_nodes[X->left].height, m_nodes[X->right].height) + 1;
+            X->category =
+                m_nodes[X->left].category | m_nodes[X->right].category;
+        }
+        sync(child);
+    }
+    sync(node);
+
+    int cursor = node;
+    while (cursor != abt::null) {
+        abt::node *X = m_nodes + cursor;
+
+        int height = max(m_nodes[X->left].height, m_nodes[X->right].height) + 1;
+        if (cursor != node && height == X->height) break;
+        X->height = height;
+
+        cursor = X->parent;
+    }
+
+    return true;
+}
+
+void abtree::swap(int a, int b) {
+    int parentA = m_nodes[a].parent;
+    int parentB = m_nodes[b].parent;
+
+    LSPE_ASSERT(parentA != abt::null && parentB != abt::null);
+    LSPE_ASSERT(parentA != parentB);
+
+    if (m_nodes[parentA].left == a) {
+        m_nodes[parentA].left = b;
+    } else {
+        m_nodes[parentA].right = b;
+    }
+
+    if (m_nodes[parentB].left == b) {
+        m_nodes[parentB].left = a;
+    } else {
+        m_nodes[parentB].right = a;
+    }
+
+    m_nodes[a].parent = parentB;
+    m_nodes[b].parent = parentA;
+}
+
+}; // namespace lspe
@@ -0,0 +1,440 @@
+#include <float.h>
+#include <malloc.h>
+
+#include <lspe/abtb.h>
+
+namespace lspe {
+
+namespace abtb {
+
+//! proxy of a full bucket waiting to be distributed by a split
+struct splitentry {
+    int   id;
+    bbox2 box;
+    float center; //! center along the split axis
+};
+
+static inline void clearLane(bucket &e, int lane) {
+    e.lowerx[lane] = e.lowery[lane] = FLT_MAX;
+    e.upperx[lane] = e.uppery[lane] = -FLT_MAX;
+    e.proxy[lane]                   = abt::null;
+}
+
+//! whether two boxes are close enough to share a bucket
+//! the union must be no larger than the sum of both perimeters
+static inline bool nearby(const bbox2 &a, const bbox2 &b) {
+    return perimeterOf(unionOf(a, b)) <= perimeterOf(a) + perimeterOf(b);
+}
+
+static inline bbox2 laneOf(const bucket &e, int lane) {
+    return {
+        vec2(e.lowerx[lane], e.lowery[lane]),
+        vec2(e.upperx[lane], e.uppery[lane])};
+}
+
+}; // namespace abtb
+
+abtreeb::abtreeb()
+    : m_buckets(nullptr)
+    , m_bucketCapacity(0)
+    , m_freebucket(abt::null)
+    , m_nbucket(0)
+    , m_proxies(nullptr)
+    , m_proxyCapacity(0)
+    , m_freeproxy(abt::null)
+    , m_nproxy(0)
+    , m_leafBuckets(nullptr)
+    , m_leafCapacity(0)
+    , m_extension(2.0f) {
+    //! leaves fit their buckets exactly, proxies carry the margin
+    m_tree.setExtension(FLT_EPSILON);
+}
+
+abtreeb::~abtreeb() {
+    ::free(m_buckets);
+    m_buckets = nullptr;
+
+    ::free(m_proxies);
+    m_proxies = nullptr;
+
+    ::free(m_leafBuckets);
+    m_leafBuckets = nullptr;
+}
+
+void abtreeb::setExtension(float r) {
+    LSPE_ASSERT(r >= FLT_EPSILON); //! assume r >= 0
+    m_extension = r;
+}
+
+int abtreeb::addObject(const bbox2 &box, void *userdata) {
+    int id                 = allocateProxy();
+    m_proxies[id].userdata = userdata;
+
+    insert(id, fatten(box, vec2(0.0f, 0.0f)));
+
+    return id;
+}
+
+void abtreeb::delObject(int id) {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].lane != abt::null);
+
+    remove(id);
+    freeProxy(id);
+}
+
+bool abtreeb::moveObject(int id, const bbox2 &box, const vec2 &displacement) {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].lane != abt::null);
+
+    const abtb::proxy &proxy = m_proxies[id];
+
+    bbox2 fattenbox = fatten(box, displacement);
+
+    const bbox2 originbox = abtb::laneOf(m_buckets[proxy.bucket], proxy.lane);
+    if (contain(originbox, box)) {
+        bbox2 bound;
+        bound.lower = fattenbox.lower - m_extension * 4.0f;
+        bound.upper = fattenbox.upper + m_extension * 4.0f;
+
+        //! the same rules as abtree::moveObject()
+        if (contain(bound, originbox)) { return false; }
+    }
+
+    //! still inside the leaf of the bucket, only the lane is rewritten
+    abtb::bucket &bucket = m_buckets[proxy.bucket];
+    if (contain(m_tree.m_nodes[bucket.leaf].box, fattenbox)) {
+        bucket.lowerx[proxy.lane] = fattenbox.lower.x;
+        bucket.lowery[proxy.lane] = fattenbox.lower.y;
+        bucket.upperx[proxy.lane] = fattenbox.upper.x;
+        bucket.uppery[proxy.lane] = fattenbox.upper.y;
+        return true;
+    }
+
+    remove(id);
+    insert(id, fattenbox);
+
+    return true;
+}
+
+bbox2 abtreeb::getFattenBBox(int id) const {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].lane != abt::null);
+
+    const abtb::proxy &proxy = m_proxies[id];
+    return abtb::laneOf(m_buckets[proxy.bucket], proxy.lane);
+}
+
+void *abtreeb::getUserdata(int id) const {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].lane != abt::null);
+
+    return m_proxies[id].userdata;
+}
+
+int abtreeb::objectCount() const {
+    return m_nproxy;
+}
+
+int abtreeb::bucketCount() const {
+    return m_nbucket;
+}
+
+int abtreeb::nodeCount() const {
+    return m_tree.m_nnode;
+}
+
+void abtreeb::query(abtb::fnvisit processor, const bbox2 &box, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(box, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+void abtreeb::query(abtb::fnvisit processor, const vec2 &point, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(point, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+int abtreeb::allocateBucket() {
+    if (m_freebucket == abt::null) { //! expand the bucket pool
+        int capacity     = m_bucketCapacity == 0 ? 16 : m_bucketCapacity * 2;
+        m_buckets        = (abtb::bucket *)realloc(
+            m_buckets, capacity * sizeof(abtb::bucket));
+        LSPE_ALWAYS_ASSERT(m_buckets != nullptr);
+
+        for (int i = m_bucketCapacity; i < capacity; ++i) {
+            m_buckets[i].leaf = i + 1 < capacity ? i + 1 : abt::null;
+        }
+        m_freebucket     = m_bucketCapacity;
+        m_bucketCapacity = capacity;
+    }
+
+    int bucket   = m_freebucket;
+    m_freebucket = m_buckets[bucket].leaf;
+
+    abtb::bucket &e = m_buckets[bucket];
+    for (int i = 0; i < abtb::capacity; ++i) { abtb::clearLane(e, i); }
+    e.leaf  = abt::null;
+    e.count = 0;
+
+    ++m_nbucket;
+    return bucket;
+}
+
+void abtreeb::freeBucket(int bucket) {
+    m_buckets[bucket].leaf = m_freebucket;
+    m_freebucket           = bucket;
+    --m_nbucket;
+}
+
+int abtreeb::allocateProxy() {
+    if (m_freeproxy == abt::null) { //! expand the proxy pool
+        int capacity = m_proxyCapacity == 0 ? 16 : m_proxyCapacity * 2;
+        m_proxies    = (abtb::proxy *)realloc(
+            m_proxies, capacity * sizeof(abtb::proxy));
+        LSPE_ALWAYS_ASSERT(m_proxies != nullptr);
+
+        for (int i = m_proxyCapacity; i < capacity; ++i) {
+            m_proxies[i].bucket = i + 1 < capacity ? i + 1 : abt::null;
+            m_proxies[i].lane   = abt::null;
+        }
+        m_freeproxy     = m_proxyCapacity;
+        m_proxyCapacity = capacity;
+    }
+
+    int id      = m_freeproxy;
+    m_freeproxy = m_proxies[id].bucket;
+
+    ++m_nproxy;
+    return id;
+}
+
+void abtreeb::freeProxy(int id) {
+    m_proxies[id].bucket = m_freeproxy;
+    m_proxies[id].lane   = abt::null;
+    m_freeproxy          = id;
+    --m_nproxy;
+}
+
+bbox2 abtreeb::fatten(const bbox2 &box, const vec2 &displacement) const {
+    bbox2 fattenbox;
+    fattenbox.lower = box.lower - m_extension;
+    fattenbox.upper = box.upper + m_extension;
+
+    //! predict movement
+    vec2 dp = displacement * 4.0f;
+    if (dp.x < FLT_EPSILON) {
+        fattenbox.lower.x += dp.x;
+    } else {
+        fattenbox.upper.x += dp.x;
+    }
+    if (dp.y < FLT_EPSILON) {
+        fattenbox.lower.y += dp.y;
+    } else {
+        fattenbox.upper.y += dp.y;
+    }
+
+    return fattenbox;
+}
+
+bbox2 abtreeb::boundOf(int bucket) const {
+    const abtb::bucket &e = m_buckets[bucket];
+    LSPE_ASSERT(e.count > 0);
+
+    bbox2 bound = abtb::laneOf(e, 0);
+    for (int i = 1; i < e.count; ++i) {
+        bound = unionOf(bound, abtb::laneOf(e, i));
+    }
+
+    return bound;
+}
+
+int abtreeb::bucketOf(int leaf) const {
+    return m_leafBuckets[leaf];
+}
+
+void abtreeb::insert(int id, const bbox2 &box) {
+    //! the best sibling for a new leaf is chosen as in abtree::insert()
+    //! the proxy joins it only if it is a bucket lying close enough
+    //! otherwise the proxy starts a new bucket next to it
+    int cursor = abt::null;
+    if (m_tree.m_root != abt::null) { cursor = m_tree.siblingOf(box); }
+
+    if (cursor == abt::null || !m_tree.m_nodes[cursor].isLeaf()
+        || !abtb::nearby(m_tree.m_nodes[cursor].box, box)) {
+        int bucket = allocateBucket();
+        place(bucket, id, box);
+        attach(bucket);
+        return;
+    }
+
+    int bucket = bucketOf(cursor);
+    if (m_buckets[bucket].count == abtb::capacity) {
+        split(bucket, id, box);
+        return;
+    }
+
+    place(bucket, id, box);
+    if (!contain(m_tree.m_nodes[cursor].box, box)) { refit(bucket); }
+}
+
+void abtreeb::remove(int id) {
+    int bucket = m_proxies[id].bucket;
+    int lane   = m_proxies[id].lane;
+
+    //! fill the hole with the last lane
+    abtb::bucket &e    = m_buckets[bucket];
+    int           last = --e.count;
+    if (lane != last) {
+        e.lowerx[lane] = e.lowerx[last];
+        e.lowery[lane] = e.lowery[last];
+        e.upperx[lane] = e.upperx[last];
+        e.uppery[lane] = e.uppery[last];
+        e.proxy[lane]  = e.proxy[last];
+
+        m_proxies[e.proxy[lane]].lane = lane;
+    }
+    abtb::clearLane(e, last);
+
+    if (e.count == 0) {
+        m_tree.delObject(e.leaf);
+        freeBucket(bucket);
+        return;
+    }
+
+    if (e.count > abtb::capacity / 4) {
+        shrink(bucket);
+        return;
+    }
+
+    //! merge a bucket running low into its sibling bucket
+    const abt::node *nodes  = m_tree.m_nodes;
+    int              parent = nodes[e.leaf].parent;
+    if (parent == abt::null) {
+        shrink(bucket);
+        return;
+    }
+
+    int sibling = nodes[parent].left == e.leaf ? nodes[parent].right
+                                               : nodes[parent].left;
+    if (!nodes[sibling].isLeaf()) {
+        shrink(bucket);
+        return;
+    }
+
+    int target = bucketOf(sibling);
+    if (m_buckets[target].count + e.count > abtb::capacity
+        || !abtb::nearby(nodes[sibling].box, boundOf(bucket))) {
+        shrink(bucket);
+        return;
+    }
+
+    for (int i = 0; i < e.count; ++i) {
+        place(target, e.proxy[i], abtb::laneOf(e, i));
+    }
+
+    m_tree.delObject(e.leaf);
+    freeBucket(bucket);
+    refit(target);
+}
+
+void abtreeb::place(int bucket, int id, const bbox2 &box) {
+    abtb::bucket &e = m_buckets[bucket];
+    LSPE_ASSERT(e.count < abtb::capacity);
+
+    int lane       = e.count++;
+    e.lowerx[lane] = box.lower.x;
+    e.lowery[lane] = box.lower.y;
+    e.upperx[lane] = box.upper.x;
+    e.uppery[lane] = box.upper.y;
+    e.proxy[lane]  = id;
+
+    m_proxies[id].bucket = bucket;
+    m_proxies[id].lane   = lane;
+}
+
+void abtreeb::split(int bucket, int id, const bbox2 &box) {
+    const int n = abtb::capacity + 1;
+
+    abtb::splitentry entries[n];
+    for (int i = 0; i < abtb::capacity; ++i) {
+        entries[i].id  = m_buckets[bucket].proxy[i];
+        entries[i].box = abtb::laneOf(m_buckets[bucket], i);
+    }
+    entries[abtb::capacity].id  = id;
+    entries[abtb::capacity].box = box;
+
+    //! split at the median along the longest axis of the centers
+    vec2 lower(FLT_MAX, FLT_MAX), upper(-FLT_MAX, -FLT_MAX);
+    for (int i = 0; i < n; ++i) {
+        vec2 c  = centerOf(entries[i].box);
+        lower.x = min(lower.x, c.x);
+        lower.y = min(lower.y, c.y);
+        upper.x = max(upper.x, c.x);
+        upper.y = max(upper.y, c.y);
+    }
+    bool alongx = upper.x - lower.x >= upper.y - lower.y;
+
+    for (int i = 0; i < n; ++i) {
+        vec2 c            = centerOf(entries[i].box);
+        entries[i].center = alongx ? c.x : c.y;
+    }
+
+    //! insertion sort, n is tiny
+    for (int i = 1; i < n; ++i) {
+        abtb::splitentry e = entries[i];
+        int              j = i - 1;
+        for (; j >= 0 && entries[j].center > e.center; --j) {
+            entries[j + 1] = entries[j];
+        }
+        entries[j + 1] = e;
+    }
+
+    //! m_buckets may be relocated by allocateBucket()
+    int other = allocateBucket();
+
+    abtb::bucket &e = m_buckets[bucket];
+    for (int i = 0; i < abtb::capacity; ++i) { abtb::clearLane(e, i); }
+    e.count = 0;
+
+    for (int i = 0; i < n; ++i) {
+        place(i < n / 2 ? bucket : other, entries[i].id, entries[i].box);
+    }
+
+    refit(bucket);
+    attach(other);
+}
+
+void abtreeb::attach(int bucket) {
+    int leaf = m_tree.addObject(boundOf(bucket), nullptr);
+
+    if (m_leafCapacity < m_tree.m_capacity) { //! follow the node pool
+        m_leafCapacity = m_tree.m_capacity;
+        m_leafBuckets  =
+            (int *)realloc(m_leafBuckets, m_leafCapacity * sizeof(int));
+        LSPE_ALWAYS_ASSERT(m_leafBuckets != nullptr);
+    }
+
+    m_leafBuckets[leaf]    = bucket;
+    m_buckets[bucket].leaf = leaf;
+}
+
+void abtreeb::shrink(int bucket) {
+    const bbox2 &leafbox = m_tree.m_nodes[m_buckets[bucket].leaf].box;
+    if (perimeterOf(leafbox) > perimeterOf(boundOf(bucket)) * 1.25f) {
+        refit(bucket);
+    }
+}
+
+void abtreeb::refit(int bucket) {
+    //! reinserts the leaf when the bound left its box or is much smaller
+    const vec2 zero(0.0f, 0.0f);
+    m_tree.moveObject(m_buckets[bucket].leaf, boundOf(bucket), zero);
+}
+
+}; // namespace lspe
@@ -16,6 +16,13 @@ float areaOf(const bbox2 &a) {
     return wh.x * wh.y;
 }
 
+bbox2 bboxOf(const obb2 &a) {
+    vec2 u = a.axis * a.extent.x;
+    vec2 v = vec2(-a.axis.y, a.axis.x) * a.extent.y;
+    vec2 r = vec2(fabs(u.x) + fabs(v.x), fabs(u.y) + fabs(v.y));
+    return {a.center - r, a.center + r};
+}
+
 bbox2 unionOf(const bbox2 &a, const bbox2 &b) {
     auto lower = vec2(min(a.lower.x, b.lower.x), min(a.lower.y, b.lower.y));
     auto upper = vec2(max(a.upper.x, b.upper.x), max(a.upper.y, b.upper.y));
@@ -28,24 +35,4 @@ bbox2 intersectionOf(const bbox2 &a, const bbox2 &b) {
     return {lower, upper};
 }
 
-bool overlap(const bbox2 &a, const bbox2 &b) {
-    auto d1 = b.lower - a.upper;
-    if (d1.x > 0 || d1.y > 0) return false;
-
-    auto d2 = a.lower - b.upper;
-    if (d2.x > 0 || d2.y > 0) return false;
-
-    return true;
-}
-
-bool contain(const bbox2 &a, const bbox2 &b) {
-    return a.lower.x <= b.lower.x && a.lower.y <= b.lower.y
-        && a.upper.x >= b.upper.x && a.upper.y >= b.upper.y;
-}
-
-bool contain(const bbox2 &a, const vec2 &b) {
-    return b.x >= a.lower.x && b.x <= a.upper.x && b.y >= a.lower.y
-        && b.y <= a.upper.y;
-}
-
 }; // namespace lspe
@@ -1,31 +1,249 @@
 #include <string.h>
+#include <algorithm>
+#include <thread>
 #include <lspe/broadphase.h>
+#include <lspe/sap.h>
+#include <lspe/grid.h>
 
 namespace lspe {
 
 using namespace broadphase;
 
+Backend *broadphase::create(int method) {
+    LSPE_ASSERT(method == ABTREE || method == SAP || method == GRID);
+
+    switch (method) {
+        case ABTREE:
+            return new BroadPhase;
+        case SAP:
+            return new SweepAndPrune;
+        case GRID:
+            return new SpatialHash;
+    }
+
+    return nullptr;
+}
+
+PairCache::PairCache()
+    : m_capacity(16)
+    , m_count(0)
+    , m_tombs(0)
+    , m_eventCapacity(16)
+    , m_eventCount(0)
+    , m_deadCapacity(16)
+    , m_deadCount(0)
+    , m_doomed(0)
+    , m_stamp(0) {
+    m_slots = (slot *)malloc(m_capacity * sizeof(slot));
+    LSPE_ASSERT(m_slots != nullptr);
+    for (int i = 0; i < m_capacity; ++i) { m_slots[i].key = empty; }
+
+    m_events = (IntPair *)malloc(m_eventCapacity * sizeof(IntPair));
+    LSPE_ASSERT(m_events != nullptr);
+
+    m_dead = (int *)malloc(m_deadCapacity * sizeof(int));
+    LSPE_ASSERT(m_dead != nullptr);
+}
+
+PairCache::~PairCache() {
+    free(m_slots);
+    m_slots = nullptr;
+
+    free(m_events);
+    m_events = nullptr;
+
+    free(m_dead);
+    m_dead = nullptr;
+}
+
+void PairCache::prepare() {
+    m_eventCount = 0;
+    ++m_stamp;
+
+    if (m_deadCount == 0 && m_doomed == 0) return;
+
+    //! one pass over the table for all removed objects
+    std::sort(m_dead, m_dead + m_deadCount);
+    auto dead = [this](int id) {
+        return std::binary_search(m_dead, m_dead + m_deadCount, id);
+    };
+
+    for (int i = 0; i < m_capacity; ++i) {
+        const slot &pair = m_slots[i];
+        if (pair.key >= tomb) continue;
+
+        int first  = (int)(uint32_t)(pair.key >> 32);
+        int second = (int)(uint32_t)pair.key;
+        if (pair.state == doomed || dead(first) || dead(second)) { kill(i); }
+    }
+
+    m_deadCount = 0;
+    m_doomed    = 0;
+}
+
+void PairCache::add(int first, int second) {
+    LSPE_ASSERT(first != second);
+
+    uint64_t key   = keyOf(first, second);
+    int      mask  = m_capacity - 1;
+    int      index = hashOf(key) & mask;
+    int      hole  = -1;
+
+    while (m_slots[index].key != empty) {
+        if (m_slots[index].key == key) {
+            m_slots[index].stamp = m_stamp;
+            return;
+        }
+        if (m_slots[index].key == tomb && hole == -1) { hole = index; }
+        index = (index + 1) & mask;
+    }
+
+    if ((m_count + m_tombs + 1) * 2 > m_capacity) {
+        //! keep the load (tombs included) under one half for short probes
+        int capacity = m_capacity;
+        while ((m_count + 1) * 3 > capacity) { capacity *= 2; }
+        rehash(capacity);
+
+        mask  = m_capacity - 1;
+        index = hashOf(key) & mask;
+        while (m_slots[index].key != empty) { index = (index + 1) & mask; }
+    } else if (hole != -1) {
+        index = hole;
+        --m_tombs;
+    }
+
+    slot &pair    = m_slots[index];
+    pair.key      = key;
+    pair.userdata = nullptr;
+    pair.stamp    = m_stamp;
+    pair.state    = fresh;
+    ++m_count;
+}
+
+void PairCache::remove(int id) {
+    if (m_deadCount == m_deadCapacity) {
+        m_deadCapacity *= 2;
+        m_dead = (int *)realloc(m_dead, m_deadCapacity * sizeof(int));
+        LSPE_ASSERT(m_dead != nullptr);
+    }
+
+    m_dead[m_deadCount] = id;
+    ++m_deadCount;
+}
+
+void PairCache::setUserdata(int first, int second, void *userdata) {
+    int index = find(keyOf(first, second));
+    LSPE_ASSERT(index != -1);
+    m_slots[index].userdata = userdata;
+}
+
+void *PairCache::getUserdata(int first, int second) const {
+    int index = find(keyOf(first, second));
+    return index == -1 ? nullptr : m_slots[index].userdata;
+}
+
+const IntPair *PairCache::getEvents(int *count) const {
+    LSPE_ASSERT(count != nullptr);
+
+    *count = m_eventCount;
+    return m_events;
+}
+
+int PairCache::pairCount() const {
+    return m_count;
+}
+
+uint64_t PairCache::keyOf(int first, int second) {
+    uint32_t lower = (uint32_t)min(first, second);
+    uint32_t upper = (uint32_t)max(first, second);
+    return (uint64_t)lower << 32 | upper;
+}
+
+uint32_t PairCache::hashOf(uint64_t key) {
+    //! finalizer of murmur3, ids are small and close to each other
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+int PairCache::find(uint64_t key) const {
+    int mask  = m_capacity - 1;
+    int index = hashOf(key) & mask;
+
+    while (m_slots[index].key != empty) {
+        if (m_slots[index].key == key) return index;
+        index = (index + 1) & mask;
+    }
+
+    return -1;
+}
+
+void PairCache::rehash(int capacity) {
+    auto oldSlots    = m_slots;
+    int  oldCapacity = m_capacity;
+
+    m_capacity = capacity;
+    m_slots    = (slot *)malloc(m_capacity * sizeof(slot));
+    LSPE_ASSERT(m_slots != nullptr);
+    for (int i = 0; i < m_capacity; ++i) { m_slots[i].key = empty; }
+
+    int mask = m_capacity - 1;
+    for (int i = 0; i < oldCapacity; ++i) {
+        if (oldSlots[i].key >= tomb) continue;
+
+        int index = hashOf(oldSlots[i].key) & mask;
+        while (m_slots[index].key != empty) { index = (index + 1) & mask; }
+        m_slots[index] = oldSlots[i];
+    }
+
+    m_tombs = 0;
+    free(oldSlots);
+}
+
+void PairCache::emit(const slot &pair, PairEvent event) {
+    if (m_eventCount == m_eventCapacity) {
+        m_eventCapacity *= 2;
+        m_events =
+            (IntPair *)realloc(m_events, m_eventCapacity * sizeof(IntPair));
+        LSPE_ASSERT(m_events != nullptr);
+    }
+
+    IntPair &e = m_events[m_eventCount];
+    e.first    = (int)(uint32_t)(pair.key >> 32);
+    e.second   = (int)(uint32_t)pair.key;
+    e.event    = event;
+    e.userdata = pair.userdata;
+    ++m_eventCount;
+}
+
+void PairCache::kill(int index) {
+    emit(m_slots[index], PairEvent::eEnd);
+
+    //! a tomb keeps the probe chains through the slot intact
+    m_slots[index].key = tomb;
+    --m_count;
+    ++m_tombs;
+}
+
 BroadPhase::BroadPhase()
     : moveCapacity(16)
     , moveCount(0)
-    , pairCapacity(16)
-    , pairCount(0)
-    , queryId(abt::null) {
+    , queryId(abt::null)
+    , dualThreshold(0.2f) {
     moveBuffer = (int *)malloc(moveCapacity * sizeof(int));
     LSPE_ASSERT(moveBuffer != nullptr);
     memset(moveBuffer, 0, moveCapacity * sizeof(int));
 
-    pairBuffer = (IntPair *)malloc(pairCapacity * sizeof(IntPair));
-    LSPE_ASSERT(pairBuffer != nullptr);
-    memset(pairBuffer, 0, pairCapacity * sizeof(IntPair));
+    //! static objects never move, a fatten margin only adds false pairs
+    staticTree.setExtension(FLT_EPSILON);
 }
 
 BroadPhase::~BroadPhase() {
     free(moveBuffer);
     moveBuffer = nullptr;
-
-    free(pairBuffer);
-    pairBuffer = nullptr;
 }
 
 int BroadPhase::addObject(const bbox2 &box, void *userdata) {
@@ -36,34 +254,105 @@ int BroadPhase::addObject(const bbox2 &box, void *userdata) {
 
 void BroadPhase::delObject(int id) {
     delMove(id);
-    tree.delObject(id);
+    pairs.remove(id);
+    if (isStatic(id)) {
+        staticTree.delObject(staticIndexOf(id));
+    } else {
+        tree.delObject(id);
+    }
 }
 
 void BroadPhase::moveObject(
     int id, const bbox2 &box, const vec2 &displacement) {
+    LSPE_ASSERT(!isStatic(id));
     bool shouldBuffer = tree.moveObject(id, box, displacement);
     if (shouldBuffer) { addMove(id); }
 }
 
-void BroadPhase::addMove(int id) {
-    if (moveCount == moveCapacity) {
-        auto oldMoveBuffer = moveBuffer;
+void BroadPhase::moveObjects(
+    const int *ids, const bbox2 *boxes, const vec2 *displacements, int n) {
+    for (int i = 0; i < n; ++i) { LSPE_ASSERT(!isStatic(ids[i])); }
 
-        moveCapacity *= 2;
-        moveBuffer   = (int *)malloc(moveCapacity * sizeof(int));
-        LSPE_ASSERT(moveBuffer != nullptr);
-        memset(moveBuffer, 0, moveCapacity * sizeof(int));
+    //! reinserted ids are written straight into the move buffer
+    reserveMoves(n);
+    moveCount += tree.moveObjects(
+        ids, boxes, displacements, n, moveBuffer + moveCount);
+}
 
-        memcpy(moveBuffer, oldMoveBuffer, moveCount * sizeof(int));
-        free(oldMoveBuffer);
+void BroadPhase::refitObjects(
+    const int *ids, const bbox2 *boxes, int n, int budget) {
+    reserveMoves(n);
+    for (int i = 0; i < n; ++i) {
+        LSPE_ASSERT(!isStatic(ids[i]));
+        tree.setObjectBBox(ids[i], boxes[i]);
+        addMove(ids[i]);
+    }
+
+    tree.refit(budget);
+}
+
+void BroadPhase::build(const bbox2 *boxes, void **userdata, int n, int *ids) {
+    LSPE_ASSERT(ids != nullptr);
+
+    //! all dynamic objects are discarded, so is every pair
+    pairs.removeIf([](int, int) { return true; });
+    tree.build(boxes, userdata, n, ids);
+
+    //! buffered dynamic ids are invalidated by the build, buffered static
+    //! ones are kept, updatePairs() still has to query them and clear
+    //! their moved marks
+    int count = 0;
+    for (int i = 0; i < moveCount; ++i) {
+        if (isStatic(moveBuffer[i])) { moveBuffer[count++] = moveBuffer[i]; }
     }
+    moveCount = count;
+
+    for (int i = 0; i < n; ++i) { addMove(ids[i]); }
+}
+
+int BroadPhase::addStaticObject(const bbox2 &box, void *userdata) {
+    int id = staticIdOf(staticTree.addObject(box, userdata));
+    addMove(id);
+    return id;
+}
+
+void BroadPhase::buildStatic(
+    const bbox2 *boxes, void **userdata, int n, int *ids) {
+    LSPE_ASSERT(ids != nullptr);
+
+    //! buffered static ids are invalidated by the build
+    for (int i = 0; i < moveCount; ++i) {
+        if (isStatic(moveBuffer[i])) { moveBuffer[i] = abt::null; }
+    }
+
+    //! the static object of a pair is always the first one
+    pairs.removeIf([](int first, int) { return isStatic(first); });
+    staticTree.build(boxes, userdata, n, ids);
+
+    for (int i = 0; i < n; ++i) {
+        ids[i] = staticIdOf(ids[i]);
+        addMove(ids[i]);
+    }
+}
+
+void BroadPhase::rebuildStatic() {
+    staticTree.rebuild(abt::SAH);
+}
+
+int BroadPhase::idOf(const abt::node *node) const {
+    LSPE_ASSERT(node != nullptr);
+    return staticTree.owns(node) ? staticIdOf(node->index) : node->index;
+}
+
+void BroadPhase::addMove(int id) {
+    reserveMoves(1);
 
     moveBuffer[moveCount] = id;
     ++moveCount;
 }
 
 void BroadPhase::delMove(int id) {
-    LSPE_ASSERT(id >= 0 && id < moveCount);
+    LSPE_ASSERT(id != abt::null);
 
     for (int i = 0; i < moveCount; ++i) {
         if (moveBuffer[i] == id) { moveBuffer[i] = abt::null; }
@@ -71,77 +360,305 @@ void BroadPhase::delMove(int id) {
 }
 
 const IntPair *BroadPhase::getPairs(int *count) const {
-    LSPE_ASSERT(count != nullptr);
-
-    *count = pairCount;
-    return pairBuffer;
+    return pairs.getEvents(count);
 }
 
-void BroadPhase::updatePairs() {
-    pairCount = 0;
+void BroadPhase::setPairUserdata(int first, int second, void *userdata) {
+    pairs.setUserdata(first, second, userdata);
+}
 
-    //! query all buffered objects and add new pairs
-    for (int i = 0; i < moveCount; ++i) {
-        queryId = moveBuffer[i];
-        if (queryId == abt::null) continue;
+void *BroadPhase::getPairUserdata(int first, int second) const {
+    return pairs.getUserdata(first, second);
+}
 
-        bbox2 box = tree.getFattenBBox(queryId);
-        tree.query(_query, box, this);
+void BroadPhase::updatePairs() {
+    pairs.prepare();
+
+    if (workers.size() > 1) {
+        queryParallel();
+    } else {
+        bool dual =
+            moveCount > 0 && moveCount >= dualThreshold * tree.objectCount();
+
+        if (dual) {
+            //! most objects were moved, a single self traversal is cheaper
+            //! than querying the tree once for each of them
+            tree.queryPairs([this](const abt::node *a, const abt::node *b) {
+                if (a->moved || b->moved) { pairs.add(a->index, b->index); }
+                return true;
+            });
+        }
+
+        //! query all buffered objects and add new pairs
+        //! static objects are never tested against each other
+        for (int i = 0; i < moveCount; ++i) {
+            queryId = moveBuffer[i];
+            if (queryId == abt::null) continue;
+
+            if (isStatic(queryId)) {
+                //! a new static object, moved dynamic objects will find it
+                //! with their own query of the static tree
+                bbox2 box =
+                    staticTree.getFattenBBox(staticIndexOf(queryId));
+                tree.query(box, [this](const abt::node *node) {
+                    if (!node->moved) { pairs.add(queryId, node->index); }
+                    return true;
+                });
+                continue;
+            }
+
+            bbox2 box = tree.getFattenBBox(queryId);
+            if (!dual) {
+                tree.query(box, [this](const abt::node *node) {
+                    return _query(node);
+                });
+            }
+            staticTree.query(box, [this](const abt::node *node) {
+                pairs.add(queryId, staticIdOf(node->index));
+                return true;
+            });
+        }
     }
 
+    //! pairs that were not found again are resolved by the moved marks
+    pairs.commit([this](int id) { return wasMoved(id); });
+
     //! all things done
     //! moveBuffer can be cleared
     for (int i = 0; i < moveCount; ++i) {
         queryId = moveBuffer[i];
         if (queryId == abt::null) continue;
 
-        tree.setUnMoved(queryId);
+        if (isStatic(queryId)) {
+            staticTree.setUnMoved(staticIndexOf(queryId));
+        } else {
+            tree.setUnMoved(queryId);
+        }
     }
 
     moveCount = 0;
 }
 
+void BroadPhase::optimize(int budget) {
+    tree.optimize(budget);
+}
+
+void BroadPhase::setMarginRange(float lower, float upper) {
+    tree.setMarginRange(lower, upper);
+}
+
+void BroadPhase::setDualTraversalThreshold(float fraction) {
+    LSPE_ASSERT(fraction >= 0.0f);
+    dualThreshold = fraction;
+}
+
+void BroadPhase::setThreads(int threads) {
+    LSPE_ASSERT(threads >= 0);
+
+    if (threads == 0) {
+        threads = max(1, int(std::thread::hardware_concurrency()));
+    }
+    workers.resize(threads);
+}
+
 void *BroadPhase::getUserdata(int id) const {
+    if (isStatic(id)) { return staticTree.getUserdata(staticIndexOf(id)); }
     return tree.getUserdata(id);
 }
 
+void BroadPhase::setCategory(int id, int32_t category) {
+    if (isStatic(id)) {
+        staticTree.setCategory(staticIndexOf(id), category);
+    } else {
+        tree.setCategory(id, category);
+    }
+}
+
 void BroadPhase::query(abt::fnvisit processor, const bbox2 &box, void *extra) {
     tree.query(processor, box, extra);
 }
 
+void BroadPhase::query(
+    broadphase::fnvisit processor, const bbox2 &box, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(box, [this, processor, extra](const abt::node *node) {
+        return processor(idOf(node), node->userdata, extra);
+    });
+}
+
+void BroadPhase::raycast(
+    broadphase::fnraycast processor,
+    const vec2           &origin,
+    const vec2           &dir,
+    float                 maxFraction,
+    void                 *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [this, processor, extra](const abt::node *node, float t) {
+        return processor(idOf(node), node->userdata, t, extra);
+    };
+
+    raycast(origin, dir, maxFraction, visitor);
+}
+
+void BroadPhase::raycast(
+    abt::fnraycast processor,
+    const vec2    &origin,
+    const vec2    &dir,
+    float          maxFraction,
+    void          *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](const abt::node *node, float t) {
+        return processor(node, t, extra);
+    };
+
+    raycast(origin, dir, maxFraction, visitor);
+}
+
+void BroadPhase::raycast(
+    abt::fnraybatch processor,
+    const vec2     *origins,
+    const vec2     *dirs,
+    const float    *maxFractions,
+    int             n,
+    void           *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](const abt::node *node, int ray, float t) {
+        return processor(node, ray, t, extra);
+    };
+
+    raycast(origins, dirs, maxFractions, n, visitor);
+}
+
+void BroadPhase::nearest(
+    abt::fnnearest processor,
+    const vec2    &point,
+    int            k,
+    float          maxDistance,
+    void          *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](const abt::node *node, float d) {
+        return processor(node, d, extra);
+    };
+
+    nearest(point, k, maxDistance, visitor);
+}
+
+void BroadPhase::sweep(
+    abt::fnsweep processor,
+    const bbox2 &box,
+    const vec2  &displacement,
+    void        *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](const abt::node *node, float t) {
+        return processor(node, t, extra);
+    };
+
+    sweep(box, displacement, visitor);
+}
+
+void BroadPhase::buildSnapshot(abtree4 &snapshot) const {
+    snapshot.build(tree);
+}
+
 void BroadPhase::traverse(abt::fnvisit visit, void *extra, int method) {
     abt::traverse(&tree, visit, extra, method);
 }
 
-bool BroadPhase::_query(const abt::node *node, void *extra) {
-    auto bp = (BroadPhase *)extra;
-    LSPE_ASSERT(bp != nullptr);
-
-    auto &tree = bp->tree;
+void BroadPhase::reserveMoves(int count) {
+    if (moveCount + count > moveCapacity) {
+        auto oldMoveBuffer = moveBuffer;
 
-    //! skip self
-    if (node->index == bp->queryId) { return true; }
+        while (moveCount + count > moveCapacity) { moveCapacity *= 2; }
+        moveBuffer = (int *)malloc(moveCapacity * sizeof(int));
+        LSPE_ASSERT(moveBuffer != nullptr);
+        memset(moveBuffer, 0, moveCapacity * sizeof(int));
 
-    //! the pair exists or etc.
-    if (tree.wasMoved(bp->queryId) && bp->queryId < node->index) {
-        return true;
+        memcpy(moveBuffer, oldMoveBuffer, moveCount * sizeof(int));
+        free(oldMoveBuffer);
     }
+}
 
-    if (bp->pairCount == bp->pairCapacity) {
-        auto oldPairBuffer = bp->pairBuffer;
+bool BroadPhase::wasMoved(int id) {
+    if (isStatic(id)) { return staticTree.wasMoved(staticIndexOf(id)); }
+    return tree.wasMoved(id);
+}
 
-        bp->pairCapacity *= 2;
-        bp->pairBuffer = (IntPair *)malloc(bp->pairCapacity * sizeof(IntPair));
-        LSPE_ASSERT(bp->pairBuffer != nullptr);
-        memset(bp->pairBuffer, 0, bp->pairCapacity * sizeof(IntPair));
+void BroadPhase::queryParallel() {
+    //! a query takes some microseconds, so a worker needs a few hundred
+    //! of them to pay for its thread
+    static const int minChunk = 256;
 
-        memcpy(bp->pairBuffer, oldPairBuffer, bp->pairCount * sizeof(IntPair));
-        free(oldPairBuffer);
+    //! a pair is packed as (first << 32 | second)
+    auto push = [](std::vector<uint64_t> &buffer, int first, int second) {
+        buffer.push_back((uint64_t)(uint32_t)first << 32 | (uint32_t)second);
+    };
+
+    if ((int)pairBuffers.size() < workers.size()) {
+        pairBuffers.resize(workers.size());
+    }
+    for (auto &buffer : pairBuffers) { buffer.clear(); }
+
+    workers.run(
+        moveCount,
+        [this, &push](int begin, int end, int w) {
+            //! the trees are only read here, each worker writes its own
+            //! buffer
+            std::vector<uint64_t> &buffer = pairBuffers[w];
+
+            for (int i = begin; i < end; ++i) {
+                int id = moveBuffer[i];
+                if (id == abt::null) continue;
+
+                if (isStatic(id)) {
+                    bbox2 box = staticTree.getFattenBBox(staticIndexOf(id));
+                    tree.query(box, [&](const abt::node *node) {
+                        if (!node->moved) { push(buffer, id, node->index); }
+                        return true;
+                    });
+                    continue;
+                }
+
+                bbox2 box = tree.getFattenBBox(id);
+                tree.query(box, [&](const abt::node *node) {
+                    //! same rules as _query()
+                    if (node->index == id) return true;
+                    if (node->moved && id < node->index) return true;
+                    push(buffer, id, node->index);
+                    return true;
+                });
+                staticTree.query(box, [&](const abt::node *node) {
+                    push(buffer, id, staticIdOf(node->index));
+                    return true;
+                });
+            }
+        },
+        minChunk);
+
+    //! the chunks are contiguous and in order, so are the buffers, and
+    //! the pairs reach the cache in the order of the serial queries
+    //! whatever the number of threads
+    for (const auto &buffer : pairBuffers) {
+        for (uint64_t pair : buffer) {
+            pairs.add((int)(uint32_t)(pair >> 32), (int)(uint32_t)pair);
+        }
     }
+}
+
+bool BroadPhase::_query(const abt::node *node) {
+    //! skip self
+    if (node->index == queryId) { return true; }
+
+    //! both objects were moved, the pair is reported by the query
+    //! of the one with the greater id
+    if (node->moved && queryId < node->index) { return true; }
 
-    bp->pairBuffer[bp->pairCount].first  = min(bp->queryId, node->index);
-    bp->pairBuffer[bp->pairCount].second = max(bp->queryId, node->index);
-    ++bp->pairCount;
+    pairs.add(queryId, node->index);
 
     return true;
 }
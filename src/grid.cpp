@@ -0,0 +1,369 @@
+#include <math.h>
+#include <malloc.h>
+#include <string.h>
+
+#include <lspe/grid.h>
+
+namespace lspe {
+
+using namespace broadphase;
+
+SpatialHash::SpatialHash()
+    : m_proxies(nullptr)
+    , m_proxyCapacity(0)
+    , m_freeproxy(abt::null)
+    , m_nproxy(0)
+    , m_entries(nullptr)
+    , m_scratch(nullptr)
+    , m_keys(nullptr)
+    , m_entryCapacity(0)
+    , m_nentry(0)
+    , m_nbucket(1)
+    , m_startCapacity(2)
+    , m_dirty(false) {
+    //! a single empty bucket until the first rebuild
+    m_starts = (int *)malloc(m_startCapacity * sizeof(int));
+    LSPE_ALWAYS_ASSERT(m_starts != nullptr);
+    memset(m_starts, 0, m_startCapacity * sizeof(int));
+
+    memset(m_levelCounts, 0, sizeof(m_levelCounts));
+    setCellSize(1.0f);
+}
+
+SpatialHash::~SpatialHash() {
+    ::free(m_proxies);
+    m_proxies = nullptr;
+
+    ::free(m_entries);
+    m_entries = nullptr;
+
+    ::free(m_scratch);
+    m_scratch = nullptr;
+
+    ::free(m_keys);
+    m_keys = nullptr;
+
+    ::free(m_starts);
+    m_starts = nullptr;
+}
+
+void SpatialHash::setCellSize(float size, int levels) {
+    LSPE_ASSERT(size >= FLT_EPSILON);
+    LSPE_ASSERT(levels >= 1 && levels <= grid::maxLevels);
+
+    m_cellSize = size;
+    m_levels   = levels;
+    for (int i = 0; i < m_levels; ++i) {
+        m_invCellSizes[i] = 1.0f / size;
+        size             *= 2.0f;
+    }
+
+    //! the grid of the last rebuild no longer matches the cells
+    m_dirty = true;
+}
+
+int SpatialHash::addObject(const bbox2 &box, void *userdata) {
+    int id                 = allocateProxy();
+    m_proxies[id].box      = box;
+    m_proxies[id].userdata = userdata;
+
+    m_dirty = true;
+    return id;
+}
+
+void SpatialHash::delObject(int id) {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    m_pairs.remove(id);
+    freeProxy(id);
+
+    m_dirty = true;
+}
+
+void SpatialHash::moveObject(
+    int id, const bbox2 &box, const vec2 & /*displacement*/) {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    m_proxies[id].box = box;
+    m_dirty           = true;
+}
+
+void SpatialHash::moveObjects(
+    const int *ids, const bbox2 *boxes, const vec2 *displacements, int n) {
+    for (int i = 0; i < n; ++i) {
+        vec2 displacement =
+            displacements != nullptr ? displacements[i] : vec2(0, 0);
+        moveObject(ids[i], boxes[i], displacement);
+    }
+}
+
+bbox2 SpatialHash::getBBox(int id) const {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    return m_proxies[id].box;
+}
+
+void *SpatialHash::getUserdata(int id) const {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    return m_proxies[id].userdata;
+}
+
+int SpatialHash::objectCount() const {
+    return m_nproxy;
+}
+
+const IntPair *SpatialHash::getPairs(int *count) const {
+    return m_pairs.getEvents(count);
+}
+
+void SpatialHash::updatePairs() {
+    m_pairs.prepare();
+
+    rebuild();
+
+    //! pairs on the same level meet in the runs of their shared cells
+    //! the scan of an entry stops at the first entry of another bucket
+    //! and only overlapping boxes touch the proxies
+    const uint32_t mask = m_nbucket - 1;
+    for (int i = 0; i < m_nentry; ++i) {
+        const grid::entry &a = m_entries[i];
+        for (int j = i + 1; j < m_nentry; ++j) {
+            const grid::entry &b = m_entries[j];
+            if (((a.cell ^ b.cell) & mask) != 0) break;
+            if (a.cell != b.cell) continue;
+
+            if (!overlap(a.box, b.box)) continue;
+            int level = m_proxies[a.id].level;
+            if (level != m_proxies[b.id].level) continue;
+            if (owns(a.cell, level, a.box, b.box)) {
+                m_pairs.add(a.id, b.id);
+            }
+        }
+    }
+
+    //! an object looks up the cells of the coarser levels for the pairs
+    //! across levels
+    for (int id = 0; id < m_proxyCapacity; ++id) {
+        const grid::proxy &proxy = m_proxies[id];
+        if (!proxy.used) continue;
+
+        for (int level = proxy.level + 1; level < m_levels; ++level) {
+            if (m_levelCounts[level] == 0) continue;
+
+            int x0 = coordOf(proxy.box.lower.x, level);
+            int y0 = coordOf(proxy.box.lower.y, level);
+            int x1 = coordOf(proxy.box.upper.x, level);
+            int y1 = coordOf(proxy.box.upper.y, level);
+
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) {
+                    uint32_t cell   = cellOf(x, y, level);
+                    int      bucket = bucketOf(cell);
+                    int      end    = m_starts[bucket + 1];
+                    for (int i = m_starts[bucket]; i < end; ++i) {
+                        const grid::entry &e = m_entries[i];
+                        if (e.cell != cell || !overlap(e.box, proxy.box)) {
+                            continue;
+                        }
+                        if (m_proxies[e.id].level != level) continue;
+                        if (owns(cell, level, e.box, proxy.box)) {
+                            m_pairs.add(id, e.id);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    //! the grid finds every overlapping pair, so a pair that was not
+    //! found has ended whether its objects moved or not
+    m_pairs.commit([](int) { return true; });
+
+    m_dirty = false;
+}
+
+void SpatialHash::setPairUserdata(int first, int second, void *userdata) {
+    m_pairs.setUserdata(first, second, userdata);
+}
+
+void *SpatialHash::getPairUserdata(int first, int second) const {
+    return m_pairs.getUserdata(first, second);
+}
+
+void SpatialHash::query(
+    grid::fnvisit processor, const bbox2 &box, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(box, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+void SpatialHash::raycast(
+    fnraycast   processor,
+    const vec2 &origin,
+    const vec2 &dir,
+    float       maxFraction,
+    void       *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](int id, void *userdata, float t) {
+        return processor(id, userdata, t, extra);
+    };
+
+    raycast(origin, dir, maxFraction, visitor);
+}
+
+int SpatialHash::allocateProxy() {
+    if (m_freeproxy == abt::null) { //! expand the proxy pool
+        int capacity = m_proxyCapacity == 0 ? 16 : m_proxyCapacity * 2;
+        m_proxies    = (grid::proxy *)realloc(
+            m_proxies, capacity * sizeof(grid::proxy));
+        LSPE_ALWAYS_ASSERT(m_proxies != nullptr);
+
+        for (int i = m_proxyCapacity; i < capacity; ++i) {
+            m_proxies[i].level = i + 1 < capacity ? i + 1 : abt::null;
+            m_proxies[i].used  = false;
+        }
+        m_freeproxy     = m_proxyCapacity;
+        m_proxyCapacity = capacity;
+    }
+
+    int id      = m_freeproxy;
+    m_freeproxy = m_proxies[id].level;
+
+    m_proxies[id].level = 0;
+    m_proxies[id].used  = true;
+    ++m_nproxy;
+    return id;
+}
+
+void SpatialHash::freeProxy(int id) {
+    m_proxies[id].level = m_freeproxy;
+    m_proxies[id].used  = false;
+    m_freeproxy         = id;
+    --m_nproxy;
+}
+
+int SpatialHash::levelOf(const bbox2 &box) const {
+    float extent = max(box.upper.x - box.lower.x, box.upper.y - box.lower.y);
+
+    int level = 0;
+    while (level + 1 < m_levels && extent * m_invCellSizes[level] > 1.0f) {
+        ++level;
+    }
+    return level;
+}
+
+int SpatialHash::coordOf(float value, int level) const {
+    return (int)floorf(value * m_invCellSizes[level]);
+}
+
+uint32_t SpatialHash::cellOf(int x, int y, int level) const {
+    uint32_t hash = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u
+                  ^ (uint32_t)level * 83492791u;
+
+    //! the bucket takes the low bits, mix the high bits into them
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+int SpatialHash::bucketOf(uint32_t cell) const {
+    return cell & (m_nbucket - 1);
+}
+
+bool SpatialHash::owns(
+    uint32_t cell, int level, const bbox2 &a, const bbox2 &b) const {
+    int x = coordOf(max(a.lower.x, b.lower.x), level);
+    int y = coordOf(max(a.lower.y, b.lower.y), level);
+    return cellOf(x, y, level) == cell;
+}
+
+void SpatialHash::rebuild() {
+    memset(m_levelCounts, 0, sizeof(m_levelCounts));
+
+    //! count the cells first to size the arrays
+    int count = 0;
+    for (int id = 0; id < m_proxyCapacity; ++id) {
+        grid::proxy &proxy = m_proxies[id];
+        if (!proxy.used) continue;
+
+        proxy.level = levelOf(proxy.box);
+        ++m_levelCounts[proxy.level];
+
+        int x0 = coordOf(proxy.box.lower.x, proxy.level);
+        int y0 = coordOf(proxy.box.lower.y, proxy.level);
+        int x1 = coordOf(proxy.box.upper.x, proxy.level);
+        int y1 = coordOf(proxy.box.upper.y, proxy.level);
+        count += (x1 - x0 + 1) * (y1 - y0 + 1);
+    }
+
+    if (count > m_entryCapacity) {
+        while (count > m_entryCapacity) {
+            m_entryCapacity = m_entryCapacity == 0 ? 16 : m_entryCapacity * 2;
+        }
+
+        m_entries = (grid::entry *)realloc(
+            m_entries, m_entryCapacity * sizeof(grid::entry));
+        m_scratch = (grid::entry *)realloc(
+            m_scratch, m_entryCapacity * sizeof(grid::entry));
+        m_keys    = (int *)realloc(m_keys, m_entryCapacity * sizeof(int));
+        LSPE_ALWAYS_ASSERT(m_entries != nullptr);
+        LSPE_ALWAYS_ASSERT(m_scratch != nullptr);
+        LSPE_ALWAYS_ASSERT(m_keys != nullptr);
+    }
+
+    //! about one bucket per cell keeps the runs short
+    m_nbucket = 16;
+    while (m_nbucket < count) { m_nbucket *= 2; }
+
+    if (m_nbucket + 1 > m_startCapacity) {
+        m_startCapacity = m_nbucket + 1;
+        m_starts = (int *)realloc(m_starts, m_startCapacity * sizeof(int));
+        LSPE_ALWAYS_ASSERT(m_starts != nullptr);
+    }
+
+    m_nentry = 0;
+    for (int id = 0; id < m_proxyCapacity; ++id) {
+        const grid::proxy &proxy = m_proxies[id];
+        if (!proxy.used) continue;
+
+        int x0 = coordOf(proxy.box.lower.x, proxy.level);
+        int y0 = coordOf(proxy.box.lower.y, proxy.level);
+        int x1 = coordOf(proxy.box.upper.x, proxy.level);
+        int y1 = coordOf(proxy.box.upper.y, proxy.level);
+
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                grid::entry &e   = m_scratch[m_nentry];
+                e.box            = proxy.box;
+                e.id             = id;
+                e.cell           = cellOf(x, y, proxy.level);
+                m_keys[m_nentry] = bucketOf(e.cell);
+                ++m_nentry;
+            }
+        }
+    }
+
+    //! counting sort by bucket, m_starts[b + 1] counts bucket b first
+    memset(m_starts, 0, (m_nbucket + 1) * sizeof(int));
+    for (int i = 0; i < m_nentry; ++i) { ++m_starts[m_keys[i] + 1]; }
+    for (int i = 0; i < m_nbucket; ++i) { m_starts[i + 1] += m_starts[i]; }
+
+    //! scattering moves each start to the end of its bucket, which is
+    //! the start of the next one, shift them back afterwards
+    for (int i = 0; i < m_nentry; ++i) {
+        m_entries[m_starts[m_keys[i]]++] = m_scratch[i];
+    }
+    memmove(m_starts + 1, m_starts, m_nbucket * sizeof(int));
+    m_starts[0] = 0;
+}
+
+}; // namespace lspe
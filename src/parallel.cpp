@@ -0,0 +1,89 @@
+#include <lspe/base/parallel.h>
+
+namespace lspe {
+
+ThreadPool::ThreadPool()
+    : m_fn(nullptr)
+    , m_task(nullptr)
+    , m_n(0)
+    , m_chunk(0)
+    , m_workers(0)
+    , m_pending(0)
+    , m_generation(0)
+    , m_quit(false) {}
+
+ThreadPool::~ThreadPool() {
+    resize(1);
+}
+
+void ThreadPool::resize(int threads) {
+    LSPE_ASSERT(threads >= 1);
+    if (threads == size()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    for (auto &e : m_threads) { e.join(); }
+    m_threads.clear();
+
+    m_quit = false;
+    m_threads.reserve(threads - 1);
+    for (int w = 1; w < threads; ++w) {
+        m_threads.emplace_back(&ThreadPool::work, this, w, m_generation);
+    }
+}
+
+int ThreadPool::size() const {
+    return (int)m_threads.size() + 1;
+}
+
+void ThreadPool::dispatch(fntask fn, void *task, int n, int workers) {
+    int chunk = (n + workers - 1) / workers;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fn      = fn;
+        m_task    = task;
+        m_n       = n;
+        m_chunk   = chunk;
+        m_workers = workers;
+        m_pending = workers - 1;
+        ++m_generation;
+    }
+    m_wake.notify_all();
+
+    fn(task, 0, min(n, chunk), 0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_pending == 0; });
+}
+
+void ThreadPool::work(int worker, uint32_t generation) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_wake.wait(lock, [this, generation] {
+            return m_quit || m_generation != generation;
+        });
+        if (m_quit) return;
+
+        //! a worker beyond the current task only catches up, dispatch()
+        //! waits for the ones within, so none of them misses a task
+        generation = m_generation;
+        if (worker >= m_workers) continue;
+
+        fntask fn    = m_fn;
+        void  *task  = m_task;
+        int    begin = min(m_n, worker * m_chunk);
+        int    end   = min(m_n, begin + m_chunk);
+
+        lock.unlock();
+        fn(task, begin, end, worker);
+        lock.lock();
+
+        if (--m_pending == 0) { m_done.notify_one(); }
+    }
+}
+
+}; // namespace lspe
@@ -0,0 +1,333 @@
+#include <float.h>
+#include <malloc.h>
+#include <algorithm>
+
+#include <lspe/sap.h>
+
+namespace lspe {
+
+using namespace broadphase;
+
+SweepAndPrune::SweepAndPrune()
+    : m_entries(nullptr)
+    , m_entryCapacity(0)
+    , m_nentry(0)
+    , m_nsorted(0)
+    , m_ndeleted(0)
+    , m_proxies(nullptr)
+    , m_proxyCapacity(0)
+    , m_freeproxy(abt::null)
+    , m_nproxy(0)
+    , m_axis(0)
+    , m_maxExtent(0.0f)
+    , m_dirty(false) {}
+
+SweepAndPrune::~SweepAndPrune() {
+    ::free(m_entries);
+    m_entries = nullptr;
+
+    ::free(m_proxies);
+    m_proxies = nullptr;
+}
+
+int SweepAndPrune::addObject(const bbox2 &box, void *userdata) {
+    if (m_nentry == m_entryCapacity) {
+        m_entryCapacity = m_entryCapacity == 0 ? 16 : m_entryCapacity * 2;
+        m_entries       = (sap::entry *)realloc(
+            m_entries, m_entryCapacity * sizeof(sap::entry));
+        LSPE_ALWAYS_ASSERT(m_entries != nullptr);
+    }
+
+    int id                 = allocateProxy();
+    m_proxies[id].userdata = userdata;
+    m_proxies[id].slot     = m_nentry;
+
+    //! appended behind the sorted part, compact() merges it in
+    sap::entry &e = m_entries[m_nentry];
+    assign(e, box);
+    e.id = id;
+    ++m_nentry;
+
+    m_dirty = true;
+    return id;
+}
+
+void SweepAndPrune::delObject(int id) {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    //! the entry stays in place until compact(), so that the slots of
+    //! the other proxies remain valid
+    m_entries[m_proxies[id].slot].id = abt::null;
+    ++m_ndeleted;
+
+    m_pairs.remove(id);
+    freeProxy(id);
+
+    m_dirty = true;
+}
+
+void SweepAndPrune::moveObject(
+    int id, const bbox2 &box, const vec2 & /*displacement*/) {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    assign(m_entries[m_proxies[id].slot], box);
+    m_dirty = true;
+}
+
+void SweepAndPrune::moveObjects(
+    const int *ids, const bbox2 *boxes, const vec2 *displacements, int n) {
+    for (int i = 0; i < n; ++i) {
+        vec2 displacement =
+            displacements != nullptr ? displacements[i] : vec2(0, 0);
+        moveObject(ids[i], boxes[i], displacement);
+    }
+}
+
+bbox2 SweepAndPrune::getBBox(int id) const {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    const sap::entry &e = m_entries[m_proxies[id].slot];
+
+    bbox2 box;
+    box.lower[m_axis]     = e.lower;
+    box.upper[m_axis]     = e.upper;
+    box.lower[1 - m_axis] = e.lowerOther;
+    box.upper[1 - m_axis] = e.upperOther;
+    return box;
+}
+
+void *SweepAndPrune::getUserdata(int id) const {
+    LSPE_ASSERT(id >= 0 && id < m_proxyCapacity);
+    LSPE_ASSERT(m_proxies[id].used);
+
+    return m_proxies[id].userdata;
+}
+
+int SweepAndPrune::objectCount() const {
+    return m_nproxy;
+}
+
+int SweepAndPrune::sweepAxis() const {
+    return m_axis;
+}
+
+const IntPair *SweepAndPrune::getPairs(int *count) const {
+    return m_pairs.getEvents(count);
+}
+
+void SweepAndPrune::updatePairs() {
+    m_pairs.prepare();
+
+    compact();
+    sort();
+    sweep();
+
+    //! the sweep finds every overlapping pair, so a pair that was not
+    //! found has ended whether its objects moved or not
+    m_pairs.commit([](int) { return true; });
+
+    m_dirty = false;
+}
+
+void SweepAndPrune::setPairUserdata(int first, int second, void *userdata) {
+    m_pairs.setUserdata(first, second, userdata);
+}
+
+void *SweepAndPrune::getPairUserdata(int first, int second) const {
+    return m_pairs.getUserdata(first, second);
+}
+
+void SweepAndPrune::query(
+    sap::fnvisit processor, const bbox2 &box, void *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    query(box, [processor, extra](int id, void *userdata) {
+        return processor(id, userdata, extra);
+    });
+}
+
+void SweepAndPrune::raycast(
+    fnraycast   processor,
+    const vec2 &origin,
+    const vec2 &dir,
+    float       maxFraction,
+    void       *extra) {
+    LSPE_ASSERT(processor != nullptr);
+
+    auto visitor = [processor, extra](int id, void *userdata, float t) {
+        return processor(id, userdata, t, extra);
+    };
+
+    raycast(origin, dir, maxFraction, visitor);
+}
+
+int SweepAndPrune::allocateProxy() {
+    if (m_freeproxy == abt::null) { //! expand the proxy pool
+        int capacity = m_proxyCapacity == 0 ? 16 : m_proxyCapacity * 2;
+        m_proxies    = (sap::proxy *)realloc(
+            m_proxies, capacity * sizeof(sap::proxy));
+        LSPE_ALWAYS_ASSERT(m_proxies != nullptr);
+
+        for (int i = m_proxyCapacity; i < capacity; ++i) {
+            m_proxies[i].slot = i + 1 < capacity ? i + 1 : abt::null;
+            m_proxies[i].used = false;
+        }
+        m_freeproxy     = m_proxyCapacity;
+        m_proxyCapacity = capacity;
+    }
+
+    int id      = m_freeproxy;
+    m_freeproxy = m_proxies[id].slot;
+
+    m_proxies[id].used = true;
+    ++m_nproxy;
+    return id;
+}
+
+void SweepAndPrune::freeProxy(int id) {
+    m_proxies[id].slot = m_freeproxy;
+    m_proxies[id].used = false;
+    m_freeproxy        = id;
+    --m_nproxy;
+}
+
+void SweepAndPrune::assign(sap::entry &e, const bbox2 &box) const {
+    e.lower      = box.lower[m_axis];
+    e.upper      = box.upper[m_axis];
+    e.lowerOther = box.lower[1 - m_axis];
+    e.upperOther = box.upper[1 - m_axis];
+}
+
+void SweepAndPrune::compact() {
+    if (m_ndeleted == 0 && m_nsorted == m_nentry) return;
+
+    auto less = [](const sap::entry &a, const sap::entry &b) {
+        return a.lower < b.lower;
+    };
+
+    //! squeeze out the deleted entries of both parts
+    int sorted = 0;
+    int count  = 0;
+    for (int i = 0; i < m_nentry; ++i) {
+        if (m_entries[i].id == abt::null) continue;
+        if (i < m_nsorted) { ++sorted; }
+        m_entries[count] = m_entries[i];
+        ++count;
+    }
+
+    //! the old part is sorted here first, since insertion sort is only
+    //! cheap while the added entries are not yet mixed in
+    m_nentry  = sorted;
+    m_nsorted = sorted;
+    sort();
+
+    std::sort(m_entries + sorted, m_entries + count, less);
+    std::inplace_merge(
+        m_entries, m_entries + sorted, m_entries + count, less);
+
+    m_nentry   = count;
+    m_nsorted  = count;
+    m_ndeleted = 0;
+
+    for (int i = 0; i < m_nentry; ++i) {
+        m_proxies[m_entries[i].id].slot = i;
+    }
+}
+
+void SweepAndPrune::sort() {
+    //! the order changes little between two steps, so nearly every
+    //! entry stays in place and the sort is close to linear
+    for (int i = 1; i < m_nsorted; ++i) {
+        if (m_entries[i - 1].lower <= m_entries[i].lower) continue;
+
+        sap::entry e = m_entries[i];
+        int        j = i;
+        while (j > 0 && m_entries[j - 1].lower > e.lower) {
+            m_entries[j]                    = m_entries[j - 1];
+            m_proxies[m_entries[j].id].slot = j;
+            --j;
+        }
+        m_entries[j]         = e;
+        m_proxies[e.id].slot = j;
+    }
+}
+
+void SweepAndPrune::sweep() {
+    //! statistics of the centers along both axes, relative to the first
+    //! center and summed in double, since far from the origin the
+    //! cancellation of sqrSum / n - mean^2 in float exceeds the variance
+    double sum[2]    = {0.0, 0.0};
+    double sqrSum[2] = {0.0, 0.0};
+    float  extent    = 0.0f;
+
+    float ref      = 0.0f;
+    float refOther = 0.0f;
+    if (m_nentry > 0) {
+        ref      = (m_entries[0].lower + m_entries[0].upper) * 0.5f;
+        refOther = (m_entries[0].lowerOther + m_entries[0].upperOther) * 0.5f;
+    }
+
+    for (int i = 0; i < m_nentry; ++i) {
+        const sap::entry &e = m_entries[i];
+
+        double center      = (e.lower + e.upper) * 0.5f - ref;
+        double centerOther = (e.lowerOther + e.upperOther) * 0.5f - refOther;
+        sum[0]    += center;
+        sqrSum[0] += center * center;
+        sum[1]    += centerOther;
+        sqrSum[1] += centerOther * centerOther;
+        extent     = max(extent, e.upper - e.lower);
+
+        //! entries behind start no earlier than e, the first one that
+        //! starts after e ends closes the sweep of e
+        for (int j = i + 1; j < m_nentry; ++j) {
+            const sap::entry &other = m_entries[j];
+            if (other.lower > e.upper) break;
+            if (other.lowerOther <= e.upperOther
+                && e.lowerOther <= other.upperOther) {
+                m_pairs.add(e.id, other.id);
+            }
+        }
+    }
+
+    m_maxExtent = extent;
+
+    if (m_nentry < 2) return;
+
+    //! switch the axis only for a clear gain, resorting is not free
+    double inv      = 1.0 / m_nentry;
+    double variance = sqrSum[0] * inv - sum[0] * inv * sum[0] * inv;
+    double other    = sqrSum[1] * inv - sum[1] * inv * sum[1] * inv;
+    if (other > variance * 1.5f) { setAxis(1 - m_axis); }
+}
+
+void SweepAndPrune::setAxis(int axis) {
+    LSPE_ASSERT(axis == 0 || axis == 1);
+    if (axis == m_axis) return;
+
+    //! queries search from the largest extent along the new axis
+    m_axis      = axis;
+    m_maxExtent = 0.0f;
+    for (int i = 0; i < m_nentry; ++i) {
+        sap::entry &e = m_entries[i];
+        std::swap(e.lower, e.lowerOther);
+        std::swap(e.upper, e.upperOther);
+        m_maxExtent = max(m_maxExtent, e.upper - e.lower);
+    }
+
+    std::sort(
+        m_entries,
+        m_entries + m_nentry,
+        [](const sap::entry &a, const sap::entry &b) {
+            return a.lower < b.lower;
+        });
+
+    for (int i = 0; i < m_nentry; ++i) {
+        m_proxies[m_entries[i].id].slot = i;
+    }
+}
+
+}; // namespace lspe
@@ -0,0 +1,384 @@
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: broadphase cross-check
+ *
+ *  @brief: compare every broadphase against brute force on random boxes
+ *
+ *  @NOTES: random steps move, delete and add dynamic objects, and add
+ *          static ones (static objects of BroadPhase, plain objects of
+ *          the others), then check the pairs, their events and queries
+ *          SweepAndPrune and SpatialHash use tight boxes, so their pairs
+ *          and events must equal those of brute force exactly
+ *          BroadPhase uses fatten boxes, so its pairs must cover brute
+ *          force and its events must follow from its own previous pairs
+ *          halfway the scene is turned from wide to tall, which makes
+ *          SweepAndPrune switch its axis
+ *******************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include <lspe/broadphase.h>
+#include <lspe/grid.h>
+#include <lspe/sap.h>
+
+using namespace lspe;
+
+namespace {
+
+typedef std::pair<int, int>       objpair;  //! objects, first < second
+typedef std::tuple<int, int, int> objevent; //! objects and event
+typedef std::set<objpair>         pairset;
+typedef std::set<objevent>        eventset;
+typedef broadphase::PairEvent     PairEvent;
+
+struct object {
+    bbox2 box;
+    bool  alive;
+    bool  isStatic;
+    int   ids[4]; //! id in each backend
+};
+
+//! a backend under test with the maps between its ids and the objects
+struct subject {
+    const char          *name;
+    broadphase::Backend *bp;
+    bool                 exact;     //! tight boxes, equal to brute force
+    bool                 hasStatic; //! addStaticObject() for static ones
+    std::map<int, int>   objects;   //! id -> object
+    std::map<int, int>   retired;   //! ids deleted during this step
+    pairset              live;      //! pairs after the last step
+    eventset             events;    //! events of the last step
+};
+
+int failures = 0;
+
+#define CHECK(cond, ...)                                  \
+    do {                                                  \
+        if (!(cond)) {                                    \
+            ++failures;                                   \
+            if (failures <= 20) {                         \
+                fprintf(stderr, "step %d: ", step);       \
+                fprintf(stderr, __VA_ARGS__);             \
+                fprintf(stderr, "\n");                    \
+            }                                             \
+        }                                                 \
+    } while (0)
+
+float uniform(float lower, float upper) {
+    return lower + (upper - lower) * (rand() / (float)RAND_MAX);
+}
+
+bbox2 randomBox(const vec2 &size) {
+    vec2 center{uniform(0.0f, size.x), uniform(0.0f, size.y)};
+
+    //! mostly small boxes, some tall ones, which are long along the axis
+    //! SweepAndPrune switches to
+    vec2 extent{uniform(0.2f, 1.5f), uniform(0.2f, 1.5f)};
+    if (rand() % 10 == 0) { extent.y *= 15.0f; }
+
+    return {center - extent, center + extent};
+}
+
+objpair pairOf(int a, int b) {
+    return a < b ? objpair(a, b) : objpair(b, a);
+}
+
+pairset bruteForce(const std::vector<object> &objects) {
+    pairset pairs;
+    for (int i = 0; i < (int)objects.size(); ++i) {
+        const object &a = objects[i];
+        if (!a.alive) continue;
+        for (int j = i + 1; j < (int)objects.size(); ++j) {
+            const object &b = objects[j];
+            if (!b.alive || (a.isStatic && b.isStatic)) continue;
+            if (overlap(a.box, b.box)) { pairs.insert(pairOf(i, j)); }
+        }
+    }
+    return pairs;
+}
+
+int add(subject &s, std::vector<object> &objects, int index) {
+    object &o  = objects[index];
+    int     id = s.hasStatic && o.isStatic
+                   ? static_cast<BroadPhase *>(s.bp)->addStaticObject(
+                       o.box, nullptr)
+                   : s.bp->addObject(o.box, nullptr);
+    s.objects[id] = index;
+    return id;
+}
+
+void del(subject &s, std::vector<object> &objects, int index, int slot) {
+    int id = objects[index].ids[slot];
+    s.bp->delObject(id);
+    s.objects.erase(id);
+    s.retired[id] = index;
+}
+
+//! collect the events of the last updatePairs() as objects
+void collect(subject &s, int step) {
+    s.events.clear();
+
+    pairset live;
+    int     count;
+    auto    pairs = s.bp->getPairs(&count);
+    for (int i = 0; i < count; ++i) {
+        const broadphase::IntPair &pair = pairs[i];
+
+        //! an ended pair may belong to an object deleted in this step,
+        //! whose id was possibly reused already
+        bool ended = pair.event == PairEvent::eEnd;
+        auto lookup = [&](int id) {
+            if (ended && s.retired.count(id)) return s.retired[id];
+            auto it = s.objects.find(id);
+            return it != s.objects.end() ? it->second : -1;
+        };
+
+        int a = lookup(pair.first);
+        int b = lookup(pair.second);
+        CHECK(a != -1 && b != -1, "%s: unknown id in a pair", s.name);
+        if (a == -1 || b == -1) continue;
+
+        objpair  key   = pairOf(a, b);
+        objevent event = {key.first, key.second, (int)pair.event};
+        CHECK(!s.events.count(event), "%s: duplicate event", s.name);
+        s.events.insert(event);
+
+        if (!ended) { live.insert(key); }
+    }
+
+    s.live = live;
+    s.retired.clear();
+}
+
+//! events that turn the pairs before into the pairs after
+eventset transition(const pairset &before, const pairset &after) {
+    eventset events;
+    for (auto &pair : after) {
+        int event = (int)(before.count(pair) ? PairEvent::eStay
+                                             : PairEvent::eBegin);
+        events.insert({pair.first, pair.second, event});
+    }
+    for (auto &pair : before) {
+        if (after.count(pair)) continue;
+        events.insert({pair.first, pair.second, (int)PairEvent::eEnd});
+    }
+    return events;
+}
+
+std::set<int> query(subject &s, const bbox2 &box) {
+    std::set<int> found;
+    s.bp->query(
+        [](int id, void *, void *extra) {
+            ((std::set<int> *)extra)->insert(id);
+            return true;
+        },
+        box,
+        &found);
+
+    std::set<int> objects;
+    for (int id : found) { objects.insert(s.objects[id]); }
+    return objects;
+}
+
+}; // namespace
+
+int main() {
+    srand(20261017);
+
+    const int nobject  = 600;
+    const int nstatic  = 40;
+    const int nstep    = 80;
+    const int flipStep = nstep / 2;
+
+    vec2 size = {240.0f, 60.0f}; //! wide first, then tall
+
+    BroadPhase    tree;
+    BroadPhase    threaded;
+    SweepAndPrune sap;
+    SpatialHash   grid;
+    threaded.setThreads(4);
+    grid.setCellSize(2.0f, 4);
+
+    subject subjects[4] = {
+        {"BroadPhase", &tree, false, true, {}, {}, {}, {}},
+        {"BroadPhase (4 threads)", &threaded, false, true, {}, {}, {}, {}},
+        {"SweepAndPrune", &sap, true, false, {}, {}, {}, {}},
+        {"SpatialHash", &grid, true, false, {}, {}, {}, {}},
+    };
+
+    std::vector<object> objects;
+    int                 step = 0;
+
+    //! static objects first, then the dynamic objects of the trees are
+    //! bulk loaded, which must keep the buffered static objects
+    for (int i = 0; i < nstatic; ++i) {
+        objects.push_back({randomBox(size), true, true, {}});
+        for (int k = 0; k < 4; ++k) {
+            objects.back().ids[k] = add(subjects[k], objects, i);
+        }
+    }
+
+    std::vector<bbox2> boxes;
+    for (int i = 0; i < nobject; ++i) {
+        objects.push_back({randomBox(size), true, false, {}});
+        boxes.push_back(objects.back().box);
+    }
+
+    for (int k = 0; k < 4; ++k) {
+        subject &s = subjects[k];
+        if (s.hasStatic) {
+            std::vector<int> ids(nobject);
+            static_cast<BroadPhase *>(s.bp)->build(
+                boxes.data(), nullptr, nobject, ids.data());
+            for (int i = 0; i < nobject; ++i) {
+                objects[nstatic + i].ids[k] = ids[i];
+                s.objects[ids[i]]           = nstatic + i;
+            }
+        } else {
+            for (int i = 0; i < nobject; ++i) {
+                objects[nstatic + i].ids[k] = add(s, objects, nstatic + i);
+            }
+        }
+    }
+
+    pairset expected;
+    for (step = 0; step < nstep; ++step) {
+        if (step == flipStep) { size = {60.0f, 240.0f}; }
+
+        for (int i = 0; i < (int)objects.size(); ++i) {
+            object &o = objects[i];
+            if (!o.alive || o.isStatic) continue;
+
+            int action = rand() % 100;
+            if (action < 2) { //! delete
+                o.alive = false;
+                for (int k = 0; k < 4; ++k) { del(subjects[k], objects, i, k); }
+                continue;
+            }
+
+            bbox2 box = o.box;
+            vec2  displacement{0.0f, 0.0f};
+            if (step == flipStep) { //! mirror the object into the tall scene
+                vec2 center  = (box.lower + box.upper) * 0.5f;
+                displacement = vec2(center.y, center.x) - center;
+            } else if (action < 50) { //! half of the objects rest
+                displacement = {uniform(-0.5f, 0.5f), uniform(-0.5f, 0.5f)};
+            } else {
+                continue;
+            }
+
+            o.box.lower = box.lower + displacement;
+            o.box.upper = box.upper + displacement;
+            for (int k = 0; k < 4; ++k) {
+                subjects[k].bp->moveObject(o.ids[k], o.box, displacement);
+            }
+        }
+
+        //! new dynamic objects, sometimes a static one
+        int nadd = rand() % 10;
+        for (int j = 0; j < nadd; ++j) {
+            bool isStatic = rand() % 4 == 0;
+            objects.push_back({randomBox(size), true, isStatic, {}});
+            int index = (int)objects.size() - 1;
+            for (int k = 0; k < 4; ++k) {
+                objects[index].ids[k] = add(subjects[k], objects, index);
+            }
+        }
+
+        pairset before = expected;
+        expected       = bruteForce(objects);
+
+        for (auto &s : subjects) {
+            pairset last = s.live;
+            s.bp->updatePairs();
+            collect(s, step);
+
+            if (s.exact) {
+                //! static pairs are not generated by BroadPhase only
+                pairset live;
+                for (auto &pair : s.live) {
+                    if (objects[pair.first].isStatic
+                        && objects[pair.second].isStatic) {
+                        continue;
+                    }
+                    live.insert(pair);
+                }
+                eventset events;
+                for (auto &event : s.events) {
+                    if (objects[std::get<0>(event)].isStatic
+                        && objects[std::get<1>(event)].isStatic) {
+                        continue;
+                    }
+                    events.insert(event);
+                }
+
+                CHECK(live == expected,
+                      "%s: %d pairs, brute force %d",
+                      s.name,
+                      (int)live.size(),
+                      (int)expected.size());
+                CHECK(events == transition(before, expected),
+                      "%s: events differ from brute force",
+                      s.name);
+            } else {
+                int missing = 0;
+                for (auto &pair : expected) {
+                    if (!s.live.count(pair)) { ++missing; }
+                }
+                CHECK(missing == 0,
+                      "%s: %d overlapping pairs missing",
+                      s.name,
+                      missing);
+                for (auto &pair : s.live) {
+                    CHECK(!objects[pair.first].isStatic
+                              || !objects[pair.second].isStatic,
+                          "%s: pair of two static objects",
+                          s.name);
+                }
+                CHECK(s.events == transition(last, s.live),
+                      "%s: events don't follow the last pairs",
+                      s.name);
+            }
+        }
+
+        CHECK(subjects[0].events == subjects[1].events,
+              "BroadPhase: threaded events differ from serial ones");
+
+        //! queries right after updatePairs(), so after an axis switch
+        for (int q = 0; q < 20; ++q) {
+            bbox2 box = randomBox(size);
+
+            std::set<int> truth;
+            for (int i = 0; i < (int)objects.size(); ++i) {
+                if (objects[i].alive && overlap(objects[i].box, box)) {
+                    truth.insert(i);
+                }
+            }
+
+            for (auto &s : subjects) {
+                std::set<int> found = query(s, box);
+                if (s.exact) {
+                    CHECK(found == truth, "%s: query differs", s.name);
+                } else {
+                    bool covered = true;
+                    for (int i : truth) { covered &= found.count(i) > 0; }
+                    CHECK(covered, "%s: query misses objects", s.name);
+                }
+            }
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("broadphase check passed (%d steps)\n", nstep);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/********************************
+ *  @author: ZYmelaii
+ *
+ *  @object: query cross-check
+ *
+ *  @brief: compare the SIMD trees (abtree4, abtreeb) against brute force
+ *
+ *  @NOTES: besides random boxes, every tree is queried with unbounded
+ *          boxes (FLT_MAX and infinity), which must report each object
+ *          exactly once, unused SIMD lanes included
+ *          the sizes are small on purpose so that nodes with unused
+ *          lanes are common
+ *******************************/
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+
+#include <lspe/abt.h>
+#include <lspe/abt4.h>
+#include <lspe/abtb.h>
+
+using namespace lspe;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond, ...)                            \
+    do {                                            \
+        if (!(cond)) {                              \
+            ++failures;                             \
+            if (failures <= 20) {                   \
+                fprintf(stderr, __VA_ARGS__);       \
+                fprintf(stderr, "\n");              \
+            }                                       \
+        }                                           \
+    } while (0)
+
+float uniform(float lower, float upper) {
+    return lower + (upper - lower) * (rand() / (float)RAND_MAX);
+}
+
+bbox2 randomBox() {
+    vec2 center{uniform(0.0f, 100.0f), uniform(0.0f, 100.0f)};
+    vec2 extent{uniform(0.2f, 4.0f), uniform(0.2f, 4.0f)};
+    return {center - extent, center + extent};
+}
+
+//! id -> number of times reported, the query is stopped once more ids
+//! than objects were reported so that a looping walk still terminates
+struct visits {
+    std::map<int, int> count;
+    int                total;
+    int                limit;
+};
+
+template <typename Tree>
+visits collect(Tree &tree, const bbox2 &box, int limit) {
+    visits v = {{}, 0, limit};
+    tree.query(box, [&v](int id, void *) {
+        ++v.count[id];
+        return ++v.total <= v.limit;
+    });
+    return v;
+}
+
+//! check the reported ids against the expected ones, each exactly once
+void expect(
+    const char *name, const visits &v, const std::map<int, bbox2> &expected) {
+    CHECK(v.total <= v.limit, "%s: query didn't terminate", name);
+    CHECK(v.count.size() == expected.size(),
+          "%s: %d objects reported, expected %d",
+          name,
+          (int)v.count.size(),
+          (int)expected.size());
+    for (auto &e : v.count) {
+        CHECK(expected.count(e.first), "%s: unexpected id %d", name, e.first);
+        CHECK(e.second == 1, "%s: id %d reported twice", name, e.first);
+    }
+}
+
+const bbox2 unbounded[] = {
+    {vec2(-FLT_MAX, -FLT_MAX), vec2(FLT_MAX, FLT_MAX)},
+    {vec2(-INFINITY, -INFINITY), vec2(INFINITY, INFINITY)},
+};
+
+void checkAbtree4(int n) {
+    abtree               tree;
+    std::map<int, bbox2> boxes; //! id -> fatten box
+    for (int i = 0; i < n; ++i) {
+        int id    = tree.addObject(randomBox(), nullptr);
+        boxes[id] = tree.getFattenBBox(id);
+    }
+
+    abtree4 snapshot;
+    snapshot.build(tree);
+
+    for (auto &box : unbounded) {
+        expect("abtree4 (unbounded)", collect(snapshot, box, n), boxes);
+    }
+
+    for (int q = 0; q < 50; ++q) {
+        bbox2 box = randomBox();
+
+        std::map<int, bbox2> truth;
+        for (auto &e : boxes) {
+            if (overlap(e.second, box)) { truth.insert(e); }
+        }
+        expect("abtree4", collect(snapshot, box, n), truth);
+    }
+}
+
+void checkAbtreeb(int n) {
+    abtreeb              tree;
+    std::map<int, bbox2> boxes; //! id -> fatten box
+    std::vector<int>     ids;
+    for (int i = 0; i < n; ++i) {
+        int id    = tree.addObject(randomBox(), nullptr);
+        boxes[id] = tree.getFattenBBox(id);
+        ids.push_back(id);
+    }
+
+    //! leave holes in the buckets
+    for (int i = 0; i < n; i += 3) {
+        tree.delObject(ids[i]);
+        boxes.erase(ids[i]);
+    }
+
+    for (auto &box : unbounded) {
+        expect("abtreeb (unbounded)", collect(tree, box, n), boxes);
+    }
+
+    for (int q = 0; q < 50; ++q) {
+        bbox2 box = randomBox();
+
+        std::map<int, bbox2> truth;
+        for (auto &e : boxes) {
+            if (overlap(e.second, box)) { truth.insert(e); }
+        }
+        expect("abtreeb", collect(tree, box, n), truth);
+    }
+}
+
+}; // namespace
+
+int main() {
+    srand(20261017);
+
+    const int sizes[] = {1, 2, 3, 4, 5, 6, 7, 9, 13, 31, 200};
+    for (int n : sizes) {
+        checkAbtree4(n);
+        checkAbtreeb(n);
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("query check passed\n");
+    return 0;
+}